@@ -1,31 +1,265 @@
 #include <iostream>
 #include <vector>
+#include <algorithm>
 #include <memory>
 #include <chrono>
 #include <fstream>
 #include <cassert>
 #include <map>
+#include <sstream>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cfloat>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
 // -------------------------------------------------
-// Miscellaneous helper functions 
+// Non-owning reference to a range of characters in
+// a larger buffer (the C++11 stand-in for string_view)
+// -------------------------------------------------
+class StringRef {
+  public:
+
+    const char* data;
+    size_t size;
+
+    StringRef() : data(nullptr), size(0) {}
+    StringRef(const char* data_, const size_t size_) : data(data_), size(size_) {}
+
+    const char* begin() const { return data; }
+    const char* end() const { return data + size; }
+
+    std::string str() const { return std::string(data, size); }
+};
+
+bool operator==(const StringRef& a, const StringRef& b) {
+  return a.size == b.size && memcmp(a.data, b.data, a.size) == 0;
+}
+
+bool operator==(const StringRef& a, const char* b) {
+  return a == StringRef(b, strlen(b));
+}
+
+bool operator!=(const StringRef& a, const char* b) {
+  return !(a == b);
+}
+
+bool operator<(const StringRef& a, const StringRef& b) {
+  int cmp = memcmp(a.data, b.data, min(a.size, b.size));
+  return cmp < 0 || (cmp == 0 && a.size < b.size);
+}
+
+std::ostream& operator<<(std::ostream& out, const StringRef& s) {
+  out.write(s.data, s.size);
+  return out;
+}
+
+// -------------------------------------------------
+// Numeric field parsing straight from a StringRef.
+// Plain decimal cells are converted without copying;
+// anything else (exponents, whitespace, inf/nan,
+// overflow, junk) goes through stoi/stof, so results
+// and errors are exactly the same as before.
 // -------------------------------------------------
 static inline
-vector<string> split_at(const string& t, const string& delimiter) {
-  string s = t;
-  size_t pos = 0;
-  std::string token;
-  vector<string> tokens;
-  while ((pos = s.find(delimiter)) != std::string::npos) {
-    token = s.substr(0, pos);
-    tokens.push_back(token);
-    s.erase(0, pos + delimiter.length());
+int parse_int(const StringRef& s) {
+  const char* p = s.begin();
+  const char* end = s.end();
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+  // Up to 9 digits always fit in an int
+  if (p < end && end - p <= 9) {
+    int val = 0;
+    for (; p < end && (unsigned) (*p - '0') <= 9; p++) {
+      val = val * 10 + (*p - '0');
+    }
+    if (p == end) {
+      return negative ? -val : val;
+    }
+  }
+  return stoi(s.str());
+}
+
+static inline
+float parse_float(const StringRef& s) {
+  // Powers of ten up to 1e10 are exact in a float, and so is any
+  // integer up to 2^24. Dividing one by the other is then a single
+  // correctly rounded operation, which is also what strtof returns.
+  static const float exactPowersOf10[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+  };
+
+  const char* p = s.begin();
+  const char* end = s.end();
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) {
+    p++;
+  }
+
+  uint64_t mantissa = 0;
+  int numDigits = 0;
+  int fracDigits = -1;
+  for (; p < end && numDigits < 19; p++) {
+    if ((unsigned) (*p - '0') <= 9) {
+      mantissa = mantissa * 10 + (*p - '0');
+      numDigits++;
+      if (fracDigits >= 0) {
+        fracDigits++;
+      }
+    } else if (*p == '.' && fracDigits < 0) {
+      fracDigits = 0;
+    } else {
+      break;
+    }
+  }
+  if (fracDigits < 0) {
+    fracDigits = 0;
+  }
+  while (fracDigits > 0 && mantissa % 10 == 0) {
+    mantissa /= 10;
+    fracDigits--;
   }
 
-  tokens.push_back(s);
+  if (FLT_EVAL_METHOD == 0 && p == end && numDigits > 0 &&
+      mantissa <= (1 << 24) && fracDigits <= 10) {
+    float val = (float) mantissa / exactPowersOf10[fracDigits];
+    return negative ? -val : val;
+  }
+  return stof(s.str());
+}
+
+// -------------------------------------------------
+// Read-only memory mapping of an input file. The pages
+// are mapped for sequential access so the kernel can
+// read ahead while the tokenizer walks the file.
+// A missing or empty file maps to an empty buffer.
+// -------------------------------------------------
+class MappedFile {
+  public:
+
+    MappedFile(const std::string& path) : addr(nullptr), len(0) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+        return;
+      }
+
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+          addr = m;
+          len = st.st_size;
+          madvise(addr, len, MADV_SEQUENTIAL);
+        }
+      }
+      close(fd);
+    }
+
+    ~MappedFile() {
+      if (addr != nullptr) {
+        munmap(addr, len);
+      }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return static_cast<const char*>(addr); }
+    size_t size() const { return len; }
+
+  private:
+
+    void* addr;
+    size_t len;
+};
+
+// -------------------------------------------------
+// Tokenized CSV file. Every cell is a StringRef into
+// the original file buffer, so the buffer must outlive
+// the CsvLines built over it.
+// -------------------------------------------------
+class CsvLine {
+  public:
+
+    const StringRef* cells;
+    size_t numCells;
+
+    CsvLine(const StringRef* cells_, const size_t numCells_) :
+      cells(cells_), numCells(numCells_) {}
+
+    size_t size() const { return numCells; }
+
+    const StringRef& at(const size_t i) const {
+      assert(i < numCells);
+      return cells[i];
+    }
+
+    const StringRef* begin() const { return cells; }
+    const StringRef* end() const { return cells + numCells; }
+
+    vector<string> strings() const {
+      vector<string> s;
+      for (auto& c : *this) {
+        s.push_back(c.str());
+      }
+      return s;
+    }
+};
+
+class CsvLines {
+  public:
 
-  return tokens;
+    // All cells of all lines, row-major
+    vector<StringRef> cells;
+    // Line i is cells[lineStarts[i], lineStarts[i + 1])
+    vector<size_t> lineStarts;
+
+    CsvLines() : lineStarts(1, 0) {}
+
+    size_t size() const { return lineStarts.size() - 1; }
+
+    CsvLine at(const size_t i) const {
+      assert(i < size());
+      return CsvLine(cells.data() + lineStarts[i], lineStarts[i + 1] - lineStarts[i]);
+    }
+};
+
+// Splits buf into lines at '\n' and each line into cells
+// at ','. Whatever follows the last '\n' is not part of
+// any line.
+static inline
+void tokenize_csv(const char* buf, const size_t len, CsvLines& lines) {
+  const char* p = buf;
+  const char* bufEnd = buf + len;
+  const char* eol;
+  while ((eol = static_cast<const char*>(memchr(p, '\n', bufEnd - p))) != nullptr) {
+    const char* cell = p;
+    const char* comma;
+    while ((comma = static_cast<const char*>(memchr(cell, ',', eol - cell))) != nullptr) {
+      lines.cells.push_back(StringRef(cell, comma - cell));
+      cell = comma + 1;
+    }
+    lines.cells.push_back(StringRef(cell, eol - cell));
+    lines.lineStarts.push_back(lines.cells.size());
+    p = eol + 1;
+  }
 }
 
 // -------------------------------------------------
@@ -150,43 +384,223 @@ std::ostream& operator<<(std::ostream& out, const Field& f) {
 }
 
 // -------------------------------------------------
-// Helper class for representing rows of fields 
+// Bump allocator for string bytes that live as long
+// as their owner: interned names and the out-of-line
+// strings of DenseTable. Memory is carved out of
+// large blocks and only released, all at once, when
+// the arena is destroyed. Blocks are never moved.
 // -------------------------------------------------
-class Record {
-
+class Arena {
   public:
 
-    map<string, Field*> fields;
+    Arena(const size_t blockBytes_ = 1 << 16) : blockBytes(blockBytes_), current(nullptr), left(0) {}
 
-    float floatAt(const std::string& name) const {
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
 
-      if (!(fields.find(name) != end(fields))) {
-        cout << "Error: No such field as " << name << " in record, which has fields" << endl;
-        for (auto r : fields) {
-          cout << "\t" << r.first << " -> " << *(r.second) << endl;
+    void* allocate(const size_t bytes, const size_t alignment = alignof(std::max_align_t)) {
+      size_t pad = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+      if (pad + bytes > left) {
+        if (bytes + alignment > blockBytes / 4) {
+          // Large requests get a block of their own, and the
+          // block being filled stays the current one
+          blocks.push_back(unique_ptr<char[]>(new char[bytes + alignment]));
+          char* p = blocks.back().get();
+          return p + (alignment - reinterpret_cast<uintptr_t>(p) % alignment) % alignment;
         }
+        blocks.push_back(unique_ptr<char[]>(new char[blockBytes]));
+        current = blocks.back().get();
+        left = blockBytes;
+        pad = (alignment - reinterpret_cast<uintptr_t>(current) % alignment) % alignment;
+      }
+      char* p = current + pad;
+      current = p + bytes;
+      left -= pad + bytes;
+      return p;
+    }
+
+    StringRef copy(const StringRef& s) {
+      char* p = static_cast<char*>(allocate(s.size, 1));
+      memcpy(p, s.data, s.size);
+      return StringRef(p, s.size);
+    }
+
+  private:
+
+    size_t blockBytes;
+    std::vector<unique_ptr<char[]> > blocks;
+    char* current;
+    size_t left;
+};
+
+// -------------------------------------------------
+// Compact tagged field value: 16 bytes, no heap
+// allocation and no virtual calls. Strings of up to
+// 14 bytes are stored inline; longer ones reference
+// bytes owned elsewhere, usually an Arena, and
+// tables copy them into their own arena with own().
+// -------------------------------------------------
+class alignas(8) Value {
+  public:
+
+    static const size_t MAX_INLINE = 14;
+
+    static Value ofInt(const int val) {
+      Value v(TAG_INT);
+      memcpy(v.payload, &val, sizeof(val));
+      return v;
+    }
+
+    static Value ofFloat(const float val) {
+      Value v(TAG_FLOAT);
+      memcpy(v.payload, &val, sizeof(val));
+      return v;
+    }
+
+    static Value ofString(const StringRef& s) {
+      if (s.size <= MAX_INLINE) {
+        Value v(TAG_INLINE_STRING);
+        memcpy(v.payload, s.data, s.size);
+        v.inlineSize = s.size;
+        return v;
+      }
+      assert(s.size <= 0xffffffff);
+      Value v(TAG_STRING_REF);
+      uint32_t size = s.size;
+      memcpy(v.payload, &s.data, sizeof(s.data));
+      memcpy(v.payload + sizeof(s.data), &size, sizeof(size));
+      return v;
+    }
+
+    // Copies a referenced string into pool. Other values are returned as is.
+    Value own(Arena& pool) const {
+      return tag == TAG_STRING_REF ? ofString(pool.copy(stringVal())) : *this;
+    }
+
+    FieldType type() const {
+      return tag == TAG_INT ? FIELD_TYPE_INT : tag == TAG_FLOAT ? FIELD_TYPE_FLOAT : FIELD_TYPE_STRING;
+    }
+
+    int intVal() const {
+      assert(tag == TAG_INT);
+      int val;
+      memcpy(&val, payload, sizeof(val));
+      return val;
+    }
+
+    float floatVal() const {
+      assert(tag == TAG_FLOAT);
+      float val;
+      memcpy(&val, payload, sizeof(val));
+      return val;
+    }
+
+    StringRef stringVal() const {
+      assert(type() == FIELD_TYPE_STRING);
+      if (tag == TAG_INLINE_STRING) {
+        return StringRef(payload, inlineSize);
+      }
+      const char* data;
+      uint32_t size;
+      memcpy(&data, payload, sizeof(data));
+      memcpy(&size, payload + sizeof(data), sizeof(size));
+      return StringRef(data, size);
+    }
+
+    bool equals(const Value& other) const {
+      if (type() != other.type()) {
+        return false;
+      }
+      if (tag == TAG_INT) {
+        return intVal() == other.intVal();
+      } else if (tag == TAG_FLOAT) {
+        return floatVal() == other.floatVal();
+      }
+      return stringVal() == other.stringVal();
+    }
+
+    void print(std::ostream& out) const {
+      if (tag == TAG_INT) {
+        out << intVal();
+      } else if (tag == TAG_FLOAT) {
+        out << floatVal();
+      } else {
+        out << stringVal();
+      }
+    }
+
+    // Adapters to and from the Field hierarchy. A Value made from a long
+    // StringField references the field's string.
+    static Value fromField(const Field& f) {
+      if (f.type() == FIELD_TYPE_INT) {
+        return ofInt(static_cast<const IntField&>(f).val);
+      } else if (f.type() == FIELD_TYPE_FLOAT) {
+        return ofFloat(static_cast<const FloatField&>(f).val);
       }
-      assert(fields.find(name) != end(fields));
+      const std::string& s = static_cast<const StringField&>(f).val;
+      return ofString(StringRef(s.data(), s.size()));
+    }
 
-      auto f = fields.at(name);
-      assert(f->type() == FIELD_TYPE_FLOAT);
-      return static_cast<FloatField*>(f)->val;
+    unique_ptr<Field> toField() const {
+      if (tag == TAG_INT) {
+        return unique_ptr<Field>(new IntField(intVal()));
+      } else if (tag == TAG_FLOAT) {
+        return unique_ptr<Field>(new FloatField(floatVal()));
+      }
+      return unique_ptr<Field>(new StringField(stringVal().str()));
     }
 
-    string stringAt(const std::string& name) const {
-      assert(fields.find(name) != end(fields));
+  private:
+
+    enum Tag : uint8_t {
+      TAG_INT,
+      TAG_FLOAT,
+      TAG_INLINE_STRING,
+      TAG_STRING_REF
+    };
+
+    char payload[MAX_INLINE];
+    uint8_t inlineSize;
+    Tag tag;
+
+    Value(const Tag tag_) : inlineSize(0), tag(tag_) {}
+};
+
+static_assert(sizeof(Value) == 16, "Value must stay 16 bytes");
+
+bool operator==(const Value& a, const Value& b) {
+  return a.equals(b);
+}
+
+std::ostream& operator<<(std::ostream& out, const Value& v) {
+  v.print(out);
+  return out;
+}
+
+// -------------------------------------------------
+// Helper class for representing rows of fields.
+// Fields are held by slot, in column order; a
+// RecordLayout resolves column names to slots once.
+// -------------------------------------------------
+class Record {
+
+  public:
+
+    vector<Field*> fields;
 
-      auto f = fields.at(name);
-      assert(f->type() == FIELD_TYPE_STRING);
-      return static_cast<StringField*>(f)->val;
+    float floatAt(const int slot) const {
+      assert(fields[slot]->type() == FIELD_TYPE_FLOAT);
+      return static_cast<FloatField*>(fields[slot])->val;
     }
 
-    int intAt(const std::string& name) const {
-      assert(fields.find(name) != end(fields));
+    const string& stringAt(const int slot) const {
+      assert(fields[slot]->type() == FIELD_TYPE_STRING);
+      return static_cast<StringField*>(fields[slot])->val;
+    }
 
-      auto f = fields.at(name);
-      assert(f->type() == FIELD_TYPE_INT);
-      return static_cast<IntField*>(f)->val;
+    int intAt(const int slot) const {
+      assert(fields[slot]->type() == FIELD_TYPE_INT);
+      return static_cast<IntField*>(fields[slot])->val;
     }
 };
 
@@ -199,6 +613,16 @@ class Table {
 
     virtual void addRecord(std::vector<unique_ptr<Field> >& r) = 0;
 
+    // Appends a row of Values. Tables that store Fields get the row
+    // through addRecord().
+    virtual void addRow(const std::vector<Value>& r) {
+      std::vector<unique_ptr<Field> > record;
+      for (auto& v : r) {
+        record.push_back(v.toField());
+      }
+      addRecord(record);
+    }
+
     virtual int numColumns() const = 0;
 
     virtual std::string getName() const = 0;
@@ -213,6 +637,54 @@ std::ostream& operator<<(std::ostream& out, const Table& t) {
   return out;
 }
 
+// -------------------------------------------------
+// Resolves the column names of a table to the slot
+// indices used by Record and by the typed columns of
+// ColumnarTable, so name lookups happen once per
+// query, not per row
+// -------------------------------------------------
+class RecordLayout {
+
+  public:
+
+    RecordLayout(const Table& table) : tableName(table.getName()) {
+      for (int i = 0; i < table.numColumns(); i++) {
+        columnNames.push_back(table.fieldName(i));
+        columnTypes.push_back(table.fieldType(i));
+      }
+    }
+
+    int numSlots() const {
+      return columnNames.size();
+    }
+
+    // Slot of the named column, which must hold values of the given type
+    int slot(const std::string& name, const FieldType type) const {
+      for (int i = 0; i < numSlots(); i++) {
+        if (columnNames[i] == name) {
+          if (columnTypes[i] != type) {
+            cout << "Error: Column " << name << " of " << tableName << " is " << columnTypes[i]
+              << ", not " << type << endl;
+          }
+          assert(columnTypes[i] == type);
+          return i;
+        }
+      }
+      cout << "Error: No such field as " << name << " in " << tableName << ", which has fields" << endl;
+      for (int i = 0; i < numSlots(); i++) {
+        cout << "\t" << columnNames[i] << " -> " << columnTypes[i] << endl;
+      }
+      assert(false);
+      return -1;
+    }
+
+  private:
+
+    std::string tableName;
+    std::vector<string> columnNames;
+    std::vector<FieldType> columnTypes;
+};
+
 // -------------------------------------------------
 // An inefficient, but usable table implementation 
 // -------------------------------------------------
@@ -223,7 +695,9 @@ class DenseTable : public Table {
     std::string name;
     std::vector<string> columnNames;
     std::vector<FieldType> columnTypes;
-    std::vector<std::vector<unique_ptr<Field> > > records;
+    std::vector<std::vector<Value> > records;
+    // Owns the bytes of strings too long to be stored inline
+    Arena pool;
 
     DenseTable(const std::string& name_,
         const std::vector<string>& columnNames_,
@@ -267,10 +741,24 @@ class DenseTable : public Table {
     }
 
     virtual void addRecord(std::vector<unique_ptr<Field> >& r) override {
-      records.push_back(std::move(r));
+      std::vector<Value> row;
+      for (auto& f : r) {
+        row.push_back(Value::fromField(*f));
+      }
+      addRow(row);
+      r.clear();
+    }
+
+    virtual void addRow(const std::vector<Value>& r) override {
+      records.push_back(std::vector<Value>());
+      for (auto& v : r) {
+        records.back().push_back(v.own(pool));
+      }
     }
 
-    const std::vector<std::vector<unique_ptr<Field> > >& rows() const { return records; }
+    const std::vector<std::vector<Value> >& rows() const { return records; }
+
+    size_t numRows() const { return records.size(); }
 
     virtual int numColumns() const override {
       return columnNames.size();
@@ -299,7 +787,7 @@ class DenseTable : public Table {
           if (i > 0) {
             out << ",";
           }
-          out << *field;
+          out << field;
           i++;
         }
         out << endl;
@@ -310,263 +798,3762 @@ class DenseTable : public Table {
 
 
 // -------------------------------------------------
-// Abstract class that represents a data structure
-// to store tables and execute queries
+// A struct-of-arrays table implementation. Every
+// column is one contiguous typed array; STRING
+// columns are end offsets into a shared byte pool.
 // -------------------------------------------------
-class QueryEngine {
-  public:
-
-    virtual void loadTablesFromCSV(const std::vector<vector<string> >& lines) = 0;
-    virtual std::unique_ptr<Table> exe() = 0;
-};
+class ColumnarTable : public Table {
 
-// -------------------------------------------------
-// Specific query engine implementation that
-// uses the DenseTable
-// -------------------------------------------------
-class ReferenceQueryEngine : public QueryEngine {
   public:
 
-    vector<DenseTable> tables;
+    std::string name;
+    std::vector<string> columnNames;
+    std::vector<FieldType> columnTypes;
 
-    // ---------------------------------------------------------------------------------
-    // Some notes on my tables:
-    // I believe the most efficient way is to perform the query with parsing and reture 
-    // stored results when exe(). But that sounds not the purpose of this assignment.
-    // Here's some bottomlines which I think is reasonable for the query engine. 
-    // 1. Datastructures contain the same amount of information with DenseTable, i.e. can 
-    // tranform from one to the other and vice versa. 
-    // 2. Only save data in loadTablesFromCSV and do not perform any query-related computation.
-    // ---------------------------------------------------------------------------------
-    vector<tuple<std::string, vector<std::string>, vector<FieldType>>> table_headers;
-    map<std::string, std::string> name_to_class;
-    map<std::string, map<int, float>> name_to_date_price, name_to_date_volume;
-    map<std::string, vector<tuple<int, int, int>>> name_to_trades;
+    ColumnarTable(const std::string& name_,
+        const std::vector<string>& columnNames_,
+        const std::vector<FieldType>& columnTypes_) :
+      name(name_), columnNames(columnNames_), columnTypes(columnTypes_),
+      columns(columnTypes_.size()) {
+        assert(columnNames.size() == columnTypes.size());
+      }
+
+    virtual std::string fieldName(const int columnNum) const override {
+      assert(columnNum < (int) columnNames.size());
+      return columnNames.at(columnNum);
+    }
 
-    virtual void loadTablesFromCSV(const std::vector<vector<string> >& lines) {
+    virtual FieldType fieldType(const int columnNum) const override {
+      assert(columnNum < (int) columnTypes.size());
+      return columnTypes.at(columnNum);
+    }
 
-      std::string cur_table;
-      int cur_table_flag;
+    virtual std::string getName() const override {
+      return name;
+    }
 
-      for (int i = 0; i < (int) lines.size(); i++)  {
-        auto l = lines.at(i);
-        assert(l.size() > 0);
-        if (l.at(0) == "<TABLE>") {
+    virtual int numColumns() const override {
+      return columnNames.size();
+    }
 
-          assert(i < (int) (lines.size()) - 2);
+    size_t numRows() const {
+      if (columns.empty()) {
+        return 0;
+      }
+      const Column& col = columns[0];
+      return columnTypes[0] == FIELD_TYPE_INT ? col.ints.size() :
+        columnTypes[0] == FIELD_TYPE_FLOAT ? col.floats.size() : col.ends.size();
+    }
 
-          auto columnNames = lines.at(i + 1);
+    virtual void addRecord(std::vector<unique_ptr<Field> >& r) override {
+      assert((int) r.size() == numColumns());
+      for (int c = 0; c < numColumns(); c++) {
+        assert(r[c]->type() == fieldType(c));
+        if (fieldType(c) == FIELD_TYPE_INT) {
+          columns[c].ints.push_back(static_cast<IntField*>(r[c].get())->val);
+        } else if (fieldType(c) == FIELD_TYPE_FLOAT) {
+          columns[c].floats.push_back(static_cast<FloatField*>(r[c].get())->val);
+        } else {
+          const std::string& s = static_cast<StringField*>(r[c].get())->val;
+          appendString(c, StringRef(s.data(), s.size()));
+        }
+      }
+    }
 
-          assert(columnNames.size() >= 1);
+    virtual void addRow(const std::vector<Value>& r) override {
+      assert((int) r.size() == numColumns());
+      for (int c = 0; c < numColumns(); c++) {
+        assert(r[c].type() == fieldType(c));
+        if (fieldType(c) == FIELD_TYPE_INT) {
+          columns[c].ints.push_back(r[c].intVal());
+        } else if (fieldType(c) == FIELD_TYPE_FLOAT) {
+          columns[c].floats.push_back(r[c].floatVal());
+        } else {
+          appendString(c, r[c].stringVal());
+        }
+      }
+    }
 
-          auto columnTypeNames = lines.at(i + 2);
+    // Column-wise appends. Every column must grow by the same
+    // number of values before the table is read again.
+    void appendInts(const int c, const vector<int32_t>& vals) {
+      assert(fieldType(c) == FIELD_TYPE_INT);
+      columns[c].ints.insert(columns[c].ints.end(), vals.begin(), vals.end());
+    }
 
-          assert(columnNames.size() == columnTypeNames.size());
+    void appendFloats(const int c, const vector<float>& vals) {
+      assert(fieldType(c) == FIELD_TYPE_FLOAT);
+      columns[c].floats.insert(columns[c].floats.end(), vals.begin(), vals.end());
+    }
 
-          vector<FieldType> columnTypes;
-          for (auto c : columnTypeNames) {
-            if (c == "STRING") {
-              columnTypes.push_back(FIELD_TYPE_STRING);
-            } else if (c == "INT") {
-              columnTypes.push_back(FIELD_TYPE_INT);
-            } else if (c == "FLOAT") {
-              columnTypes.push_back(FIELD_TYPE_FLOAT);
-            } else {
-              cout << "Error: Unrecognized column type: " << c << endl;
-              assert(false);
-            }
-          }
-          tables.push_back(DenseTable(l.at(1), columnNames, columnTypes));
-
-          cur_table = l.at(1);
-          table_headers.push_back(make_tuple(cur_table, columnNames, columnTypes));
-          if (cur_table == "tradable") {
-            cur_table_flag = TRADABLE;
-          } else if (cur_table == "price-over-time") {
-            cur_table_flag = PRICE_OVER_TIME;
-          } else if (cur_table == "volume-over-time") {
-            cur_table_flag = VOLUME_OVER_TIME;
-          } else if (cur_table == "trades") {
-            cur_table_flag = TRADES;
-          } // else assert(false);
+    void appendString(const int c, const StringRef& s) {
+      assert(fieldType(c) == FIELD_TYPE_STRING);
+      Column& col = columns[c];
+      col.bytes.insert(col.bytes.end(), s.begin(), s.end());
+      col.ends.push_back(col.bytes.size());
+    }
 
-          i += 2;
-        } else {
-          assert(tables.size() > 0);
-
-          DenseTable& currentTable = tables.back();
-          int numCols = currentTable.numColumns();
-          assert(numCols == l.size());
-
-          vector<unique_ptr<Field> > record;
-          for (int c = 0; c < numCols; c++) {
-            FieldType tp = currentTable.fieldType(c);
-            if (tp == FIELD_TYPE_STRING) {
-              record.push_back(unique_ptr<Field>(new StringField(l.at(c))));
-            } else if (tp == FIELD_TYPE_INT) {
-              record.push_back(unique_ptr<Field>(new IntField(stoi(l.at(c)))));
-            } else if (tp == FIELD_TYPE_FLOAT) {
-              record.push_back(unique_ptr<Field>(new FloatField(stof(l.at(c)))));
-            } else {
-              cout << "Unreconized field type: " << tp << endl;
-              assert(false);
-            }
-          }
+    const vector<int32_t>& intColumn(const int c) const {
+      assert(fieldType(c) == FIELD_TYPE_INT);
+      return columns[c].ints;
+    }
 
-          std::string name, asset_class;
-          int id, day, quant;
-          float price, volume;
-          switch (cur_table_flag)
-          {
-          case TRADABLE: {
-            name = static_cast<StringField*>(record[0].get())->val;
-            asset_class = static_cast<StringField*>(record[1].get())->val;
-            name_to_class.insert({name, asset_class});
-            break;
-          }
-          case PRICE_OVER_TIME: {
-            name = static_cast<StringField*>(record[1].get())->val;
-            day = static_cast<IntField*>(record[0].get())->val;
-            price = static_cast<FloatField*>(record[2].get())->val;
-            auto search = name_to_date_price.find(name);
-            if (search != name_to_date_price.end()) {
-              (search->second).insert({day, price});
-            } else {
-              auto price_map = map<int, float>{{day, price}};
-              name_to_date_price.insert({name, price_map});
-            }
-            break;
-          }
-          case VOLUME_OVER_TIME: {
-            name = static_cast<StringField*>(record[1].get())->val;
-            day = static_cast<IntField*>(record[0].get())->val;
-            volume = static_cast<FloatField*>(record[2].get())->val;
-            auto search = name_to_date_volume.find(name);
-            if (search != name_to_date_volume.end()) {
-              (search->second).insert({day, volume});
-            } else {
-              auto volume_map = map<int, float>{{day, volume}};
-              name_to_date_volume.insert({name, volume_map});
-            }
-            break;
-          }
-          case TRADES: {
-            name = static_cast<StringField*>(record[2].get())->val;
-            day = static_cast<IntField*>(record[1].get())->val;
-            id = static_cast<IntField*>(record[0].get())->val;
-            quant = static_cast<IntField*>(record[3].get())->val;
-            auto search = name_to_trades.find(name);
-            if (search != name_to_trades.end()) {
-              (search->second).push_back(make_tuple(id, day, quant));
-            } else {
-              auto vec = vector<tuple<int, int, int>>{make_tuple(id, day, quant)};
-              name_to_trades.insert({name, vec});
-            }
-            break;
-          }
-          default:
-            break; // assert(false)
-          }
-          currentTable.addRecord(record);
-        }
-      }
+    const vector<float>& floatColumn(const int c) const {
+      assert(fieldType(c) == FIELD_TYPE_FLOAT);
+      return columns[c].floats;
+    }
 
+    StringRef stringAt(const int c, const size_t row) const {
+      assert(fieldType(c) == FIELD_TYPE_STRING);
+      const Column& col = columns[c];
+      uint64_t begin = row == 0 ? 0 : col.ends[row - 1];
+      return StringRef(col.bytes.data() + begin, col.ends[row] - begin);
     }
 
-    virtual std::unique_ptr<Table> exe() {
-      // STUDENTS: FILL IN THIS FUNCTION
+    // A STRING column resolved to its arrays, so that reading a row is two
+    // offset loads. Appending to the table invalidates it.
+    class StringColumn {
+      public:
 
-      auto valid_stock_cnt = 0, valid_bond_cnt = 0;
-      auto valid_flag = false;
-      for (auto ite = name_to_class.begin(); ite != name_to_class.end(); ++ite) {
-        if (ite->second != "stock" && ite->second != "bond" ) {
-          continue;
+        StringColumn(const uint64_t* ends_, const char* bytes_) : ends(ends_), bytes(bytes_) {}
+
+        StringRef operator[](const size_t row) const {
+          uint64_t begin = row == 0 ? 0 : ends[row - 1];
+          return StringRef(bytes + begin, ends[row] - begin);
         }
-        auto& name = ite->first;
 
-        auto trades_ite = name_to_trades.find(name);
-        if (trades_ite == name_to_trades.end())
-          continue;
-        
-        auto search = name_to_date_price.find(name);
-        if (search != name_to_date_price.end()) {
-          auto& date_to_price = search->second;
-          valid_flag = true;
-          for (auto ite2 = date_to_price.lower_bound(13); ite2 != date_to_price.end() && ite2->first <= 268; ++ite2) {
-            if (ite2->second > 299.0) {
-              valid_flag = false;
-              break;
+      private:
+
+        const uint64_t* ends;
+        const char* bytes;
+    };
+
+    StringColumn stringColumn(const int c) const {
+      assert(fieldType(c) == FIELD_TYPE_STRING);
+      return StringColumn(columns[c].ends.data(), columns[c].bytes.data());
+    }
+
+    virtual void print(std::ostream& out) const override {
+
+      out << "<TABLE>," << getName() << endl;
+      for (int i = 0; i < numColumns(); i++) {
+        if (i > 0) {
+          out << ",";
+        }
+        out << fieldType(i);
+      }
+      out << endl;
+      for (int i = 0; i < numColumns(); i++) {
+        if (i > 0) {
+          out << ",";
+        }
+        out << fieldName(i);
+      }
+      out << endl;
+      for (size_t r = 0; r < numRows(); r++) {
+        for (int i = 0; i < numColumns(); i++) {
+          if (i > 0) {
+            out << ",";
+          }
+          if (fieldType(i) == FIELD_TYPE_INT) {
+            out << columns[i].ints[r];
+          } else if (fieldType(i) == FIELD_TYPE_FLOAT) {
+            out << columns[i].floats[r];
+          } else {
+            out << stringAt(i, r);
+          }
+        }
+        out << endl;
+      }
+    }
+
+  private:
+
+    struct Column {
+      vector<int32_t> ints;
+      vector<float> floats;
+      // Row r of a STRING column is bytes[ends[r - 1], ends[r])
+      vector<uint64_t> ends;
+      vector<char> bytes;
+    };
+
+    std::vector<Column> columns;
+};
+
+// -------------------------------------------------
+// Structural index over a CSV buffer, in the spirit
+// of simdjson's stage 1: each 64 byte block is turned
+// into a bitmask of its ',' and '\n' bytes with SIMD
+// compares, and the parser walks the set bits instead
+// of searching for every delimiter separately.
+// -------------------------------------------------
+class StructuralScanner {
+  public:
+
+    StructuralScanner(const char* begin_, const char* end_) :
+      block(begin_), end(end_), delimiters(0) {
+        if (block < end) {
+          loadBlock();
+        }
+      }
+
+    // Returns the next ',' or '\n' in the buffer, or end if there is none
+    const char* next() {
+      while (delimiters == 0) {
+        block += 64;
+        if (block >= end) {
+          return end;
+        }
+        loadBlock();
+      }
+      const char* pos = block + __builtin_ctzll(delimiters);
+      delimiters &= delimiters - 1;
+      return pos;
+    }
+
+  private:
+
+    const char* block;
+    const char* end;
+    uint64_t delimiters;
+
+    void loadBlock() {
+      if (end - block >= 64) {
+        scan64(block);
+      } else {
+        // Pad the tail so the vector loads stay inside the buffer
+        char tail[64] = {0};
+        memcpy(tail, block, end - block);
+        scan64(tail);
+      }
+    }
+
+    void scan64(const char* p) {
+      delimiters = 0;
+#if defined(__AVX2__)
+      const __m256i comma = _mm256_set1_epi8(',');
+      const __m256i nl = _mm256_set1_epi8('\n');
+      for (int i = 0; i < 64; i += 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, comma), _mm256_cmpeq_epi8(v, nl));
+        delimiters |= (uint64_t) (uint32_t) _mm256_movemask_epi8(hits) << i;
+      }
+#elif defined(__SSE2__)
+      const __m128i comma = _mm_set1_epi8(',');
+      const __m128i nl = _mm_set1_epi8('\n');
+      for (int i = 0; i < 64; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, nl));
+        delimiters |= (uint64_t) (uint32_t) _mm_movemask_epi8(hits) << i;
+      }
+#else
+      for (int i = 0; i < 64; i++) {
+        delimiters |= (uint64_t) (p[i] == ',' || p[i] == '\n') << i;
+      }
+#endif
+    }
+};
+
+// -------------------------------------------------
+// Column names and types of one <TABLE> section
+// -------------------------------------------------
+class TableSchema {
+  public:
+
+    std::string name;
+    std::vector<string> columnNames;
+    std::vector<FieldType> columnTypes;
+
+    int numColumns() const {
+      return columnNames.size();
+    }
+
+    // Builds the schema from the "<TABLE>,name" line and the
+    // column name and column type lines that follow it
+    static TableSchema fromHeader(const CsvLine& tableLine,
+        const CsvLine& columnNameLine,
+        const CsvLine& columnTypeLine) {
+      TableSchema schema;
+      if (!parse(tableLine, columnNameLine, columnTypeLine, schema)) {
+        cout << "Error: Malformed header of table section" << endl;
+        assert(false);
+      }
+      return schema;
+    }
+
+    // Like fromHeader, but returns false on a malformed header
+    // instead of failing, for headers read back from a snapshot
+    static bool parse(const CsvLine& tableLine,
+        const CsvLine& columnNameLine,
+        const CsvLine& columnTypeLine,
+        TableSchema& schema) {
+      if (tableLine.size() < 2 || tableLine.at(0) != "<TABLE>" ||
+          columnNameLine.size() < 1 ||
+          columnNameLine.size() != columnTypeLine.size()) {
+        return false;
+      }
+
+      schema.name = tableLine.at(1).str();
+      schema.columnNames = columnNameLine.strings();
+      schema.columnTypes.clear();
+      for (auto& c : columnTypeLine) {
+        if (c == "STRING") {
+          schema.columnTypes.push_back(FIELD_TYPE_STRING);
+        } else if (c == "INT") {
+          schema.columnTypes.push_back(FIELD_TYPE_INT);
+        } else if (c == "FLOAT") {
+          schema.columnTypes.push_back(FIELD_TYPE_FLOAT);
+        } else {
+          return false;
+        }
+      }
+      return true;
+    }
+};
+
+// -------------------------------------------------
+// Typed column buffers for a run of rows of one
+// table. Only the vector matching the column type
+// is used. STRING cells reference the input buffer.
+// Columns the engine does not require stay empty.
+// -------------------------------------------------
+class ColumnBuffer {
+  public:
+
+    FieldType type;
+    bool required;
+    vector<int> ints;
+    vector<float> floats;
+    vector<StringRef> strings;
+
+    ColumnBuffer(const FieldType type_, const bool required_) :
+      type(type_), required(required_) {}
+
+    void append(const StringRef& cell) {
+      if (type == FIELD_TYPE_STRING) {
+        strings.push_back(cell);
+      } else if (type == FIELD_TYPE_INT) {
+        ints.push_back(parse_int(cell));
+      } else if (type == FIELD_TYPE_FLOAT) {
+        floats.push_back(parse_float(cell));
+      } else {
+        cout << "Unreconized field type: " << type << endl;
+        assert(false);
+      }
+    }
+};
+
+// -------------------------------------------------
+// Row decoders specialized at compile time for a
+// list of column kinds. Each instantiation parses a
+// row as straight-line code without looking at the
+// column types. Columns that are not required are
+// still delimited, and everything after the last
+// required column is skipped.
+// -------------------------------------------------
+struct IntColumn {
+  static const FieldType type = FIELD_TYPE_INT;
+  static const bool required = true;
+  static void append(ColumnBuffer& col, const StringRef& cell) { col.ints.push_back(parse_int(cell)); }
+};
+
+struct FloatColumn {
+  static const FieldType type = FIELD_TYPE_FLOAT;
+  static const bool required = true;
+  static void append(ColumnBuffer& col, const StringRef& cell) { col.floats.push_back(parse_float(cell)); }
+};
+
+struct StringColumn {
+  static const FieldType type = FIELD_TYPE_STRING;
+  static const bool required = true;
+  static void append(ColumnBuffer& col, const StringRef& cell) { col.strings.push_back(cell); }
+};
+
+template <FieldType tp>
+struct SkippedColumn {
+  static const FieldType type = tp;
+  static const bool required = false;
+  static void append(ColumnBuffer&, const StringRef&) {}
+};
+
+template <typename... Columns>
+struct AnyRequired {
+  static const bool value = false;
+};
+
+template <typename Column, typename... Rest>
+struct AnyRequired<Column, Rest...> {
+  static const bool value = Column::required || AnyRequired<Rest...>::value;
+};
+
+// Parses the rows in [begin, end) into columns and returns how many there were
+typedef size_t (*RowParser)(vector<ColumnBuffer>& columns, const char* begin, const char* end);
+
+template <typename... Columns>
+class RowDecoder {
+  public:
+
+    static bool matches(const TableSchema& schema, const vector<bool>& required) {
+      static const FieldType types[] = {Columns::type...};
+      static const bool isRequired[] = {Columns::required...};
+      if (schema.numColumns() != (int) sizeof...(Columns)) {
+        return false;
+      }
+      for (size_t c = 0; c < sizeof...(Columns); c++) {
+        if (schema.columnTypes[c] != types[c] || required[c] != isRequired[c]) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static size_t appendRows(vector<ColumnBuffer>& columns, const char* begin, const char* end) {
+      size_t numRows = 0;
+      const char* p = begin;
+      const char* eol;
+      while (p < end && (eol = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr) {
+        decode<0, Columns...>(columns, p, eol);
+        numRows++;
+        p = eol + 1;
+      }
+      return numRows;
+    }
+
+  private:
+
+    template <size_t c>
+    static void decode(vector<ColumnBuffer>&, const char*, const char*) {}
+
+    template <size_t c, typename Column, typename... Rest>
+    static void decode(vector<ColumnBuffer>& columns, const char* cell, const char* eol) {
+      if (!AnyRequired<Column, Rest...>::value) {
+        // The skipped cells are not split, but must still all be there
+        assert(std::count(cell, eol, ',') == (ptrdiff_t) sizeof...(Rest));
+        return;
+      }
+      const char* cellEnd = eol;
+      if (sizeof...(Rest) > 0) {
+        cellEnd = static_cast<const char*>(memchr(cell, ',', eol - cell));
+        assert(cellEnd != nullptr);
+      } else {
+        assert(memchr(cell, ',', eol - cell) == nullptr);
+      }
+      Column::append(columns[c], StringRef(cell, cellEnd - cell));
+      decode<c + 1, Rest...>(columns, cellEnd + 1, eol);
+    }
+};
+
+// Decoders for the tables of the database, both fully loaded and with
+// the projection of ReferenceQueryEngine. Returns nullptr for any other
+// table or column selection, which then goes through the generic parser.
+static inline
+RowParser specialized_row_parser(const TableSchema& schema, const vector<bool>& required) {
+  typedef RowDecoder<StringColumn, StringColumn> Tradable;
+  typedef RowDecoder<IntColumn, StringColumn, FloatColumn> OverTime;
+  typedef RowDecoder<IntColumn, IntColumn, StringColumn, IntColumn> Trades;
+  typedef RowDecoder<SkippedColumn<FIELD_TYPE_INT>, IntColumn,
+          StringColumn, SkippedColumn<FIELD_TYPE_INT> > TradeDays;
+
+  if (schema.name == "tradable" && Tradable::matches(schema, required)) {
+    return &Tradable::appendRows;
+  } else if ((schema.name == "price-over-time" || schema.name == "volume-over-time") &&
+      OverTime::matches(schema, required)) {
+    return &OverTime::appendRows;
+  } else if (schema.name == "trades" && Trades::matches(schema, required)) {
+    return &Trades::appendRows;
+  } else if (schema.name == "trades" && TradeDays::matches(schema, required)) {
+    return &TradeDays::appendRows;
+  }
+  return nullptr;
+}
+
+enum CsvScanner {
+  SCANNER_MEMCHR,
+  SCANNER_SIMD
+};
+
+class ColumnBatch {
+  public:
+
+    const TableSchema* schema;
+    vector<ColumnBuffer> columns;
+    size_t numRows;
+
+    // required[c] says whether column c is converted and stored.
+    // Cells after the last required column are not even split.
+    ColumnBatch(const TableSchema& schema_, const vector<bool>& required) :
+      schema(&schema_), numRows(0),
+      rowParser(specialized_row_parser(schema_, required)), lastRequired(-1) {
+        assert((int) required.size() == schema->numColumns());
+        for (int c = 0; c < schema->numColumns(); c++) {
+          columns.push_back(ColumnBuffer(schema->columnTypes[c], required[c]));
+          if (required[c]) {
+            lastRequired = c;
+          }
+        }
+      }
+
+    // Parses every line in [begin, end). end must be one past a '\n'.
+    void appendRows(const char* begin, const char* end) {
+      if (rowParser != nullptr) {
+        numRows += rowParser(columns, begin, end);
+        return;
+      }
+
+      const int numCols = columns.size();
+      const char* p = begin;
+      const char* eol;
+      while (p < end && (eol = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr) {
+        const char* cell = p;
+        for (int c = 0; c < lastRequired; c++) {
+          const char* comma = static_cast<const char*>(memchr(cell, ',', eol - cell));
+          assert(comma != nullptr);
+          appendCell(c, StringRef(cell, comma - cell));
+          cell = comma + 1;
+        }
+        if (lastRequired >= 0) {
+          const char* cellEnd = eol;
+          if (lastRequired < numCols - 1) {
+            cellEnd = static_cast<const char*>(memchr(cell, ',', eol - cell));
+            assert(cellEnd != nullptr);
+          }
+          appendCell(lastRequired, StringRef(cell, cellEnd - cell));
+        }
+        // The cells after lastRequired are not split, but must still all be there
+        assert(std::count(cell, eol, ',') == numCols - 1 - (lastRequired >= 0 ? lastRequired : 0));
+        numRows++;
+        p = eol + 1;
+      }
+    }
+
+    // Same as appendRows, but walks the delimiters of a StructuralScanner
+    void appendRowsSimd(const char* begin, const char* end) {
+      const int numCols = columns.size();
+      StructuralScanner scanner(begin, end);
+      const char* cell = begin;
+      const char* delim;
+      while ((delim = scanner.next()) != end) {
+        for (int c = 0; c < lastRequired; c++) {
+          assert(*delim == ',');
+          appendCell(c, StringRef(cell, delim - cell));
+          cell = delim + 1;
+          delim = scanner.next();
+          assert(delim != end);
+        }
+        if (lastRequired >= 0) {
+          assert(*delim == (lastRequired < numCols - 1 ? ',' : '\n'));
+          appendCell(lastRequired, StringRef(cell, delim - cell));
+        }
+        // delim ends cell c. The rest of the row is not converted, but
+        // must still have exactly numCols cells.
+        int c = lastRequired >= 0 ? lastRequired : 0;
+        while (*delim != '\n') {
+          delim = scanner.next();
+          assert(delim != end);
+          c++;
+        }
+        assert(c == numCols - 1);
+        numRows++;
+        cell = delim + 1;
+      }
+    }
+
+    void appendRows(const char* begin, const char* end, const CsvScanner scanner) {
+      if (scanner == SCANNER_SIMD) {
+        appendRowsSimd(begin, end);
+      } else {
+        appendRows(begin, end);
+      }
+    }
+
+    void clear() {
+      for (auto& col : columns) {
+        col.ints.clear();
+        col.floats.clear();
+        col.strings.clear();
+      }
+      numRows = 0;
+    }
+
+  private:
+
+    RowParser rowParser;
+    int lastRequired;
+
+    void appendCell(const int c, const StringRef& cell) {
+      if (columns[c].required) {
+        columns[c].append(cell);
+      }
+    }
+};
+
+// -------------------------------------------------
+// Abstract class that represents a data structure
+// to store tables and execute queries
+// -------------------------------------------------
+class QueryEngine {
+  public:
+
+    // Loaders call beginTable() at every <TABLE> section, hand the
+    // section's rows over in order with appendRows(), and call
+    // finishLoad() once the input is exhausted. A batch is only
+    // valid for the duration of the appendRows() call.
+    virtual void beginTable(const TableSchema& schema) = 0;
+    virtual void appendRows(const ColumnBatch& batch) = 0;
+    virtual void finishLoad() {}
+
+    // The columns of a table that the engine's queries read. Loaders
+    // only convert these and leave the other buffers of a batch empty.
+    virtual vector<bool> requiredColumns(const TableSchema& schema) const {
+      return vector<bool>(schema.numColumns(), true);
+    }
+
+    virtual std::unique_ptr<Table> exe() = 0;
+};
+
+// -------------------------------------------------
+// Line helpers shared by the buffer based loaders
+// -------------------------------------------------
+
+// Returns the start of the line following the one containing p,
+// or nullptr if that line does not end with a '\n' before end
+static inline
+const char* next_line(const char* p, const char* end) {
+  const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+  return eol == nullptr ? nullptr : eol + 1;
+}
+
+// Returns the first "<TABLE>,..." line in [p, end), or nullptr.
+// p must point at the start of a line.
+static inline
+const char* find_table_line(const char* p, const char* end) {
+  const char* lineStart = p;
+  while (p < end) {
+    const char* hit = static_cast<const char*>(memmem(p, end - p, "<TABLE>", 7));
+    if (hit == nullptr) {
+      return nullptr;
+    }
+    if ((hit == lineStart || hit[-1] == '\n') &&
+        end - hit > 7 && (hit[7] == ',' || hit[7] == '\n')) {
+      return hit;
+    }
+    p = hit + 1;
+  }
+  return nullptr;
+}
+
+// Splits the next <TABLE> section off the complete lines in [p, end),
+// p at the start of a line. rowsEnd is set to the end of the rows at p,
+// which is the next header or end. If that header is complete, it is
+// parsed into schema and the start of its rows is returned; otherwise,
+// or if there is no header, nullptr.
+static inline
+const char* next_table_section(const char* p, const char* end, const char*& rowsEnd, TableSchema& schema) {
+  const char* hit = find_table_line(p, end);
+  rowsEnd = hit != nullptr ? hit : end;
+  if (hit == nullptr) {
+    return nullptr;
+  }
+
+  // The two lines after <TABLE> are always the column names and types
+  const char* namesLine = next_line(hit, end);
+  const char* typesLine = namesLine != nullptr ? next_line(namesLine, end) : nullptr;
+  const char* rows = typesLine != nullptr ? next_line(typesLine, end) : nullptr;
+  if (rows == nullptr) {
+    return nullptr;
+  }
+
+  CsvLines header;
+  tokenize_csv(hit, rows - hit, header);
+  schema = TableSchema::fromHeader(header.at(0), header.at(1), header.at(2));
+  return rows;
+}
+
+// -------------------------------------------------
+// Multithreaded loader. It first finds the <TABLE>
+// sections, then splits the rows of every section
+// into newline-aligned chunks. Worker threads parse
+// the chunks into their own ColumnBatch, and the
+// batches are handed to the engine in file order.
+// -------------------------------------------------
+class ParallelCsvLoader {
+  public:
+
+    ParallelCsvLoader(const int numThreads_, const CsvScanner scanner_ = SCANNER_MEMCHR) :
+      numThreads(max(numThreads_, 1)), scanner(scanner_) {}
+
+    // Returns the number of lines loaded
+    size_t load(const char* buf, const size_t len, QueryEngine& engine) {
+      // As in tokenize_csv, text after the last '\n' is ignored
+      const char* end = buf + len;
+      while (end > buf && end[-1] != '\n') {
+        end--;
+      }
+
+      vector<TableSection> sections = findSections(buf, end);
+      for (auto& section : sections) {
+        section.required = engine.requiredColumns(section.schema);
+      }
+
+      vector<Chunk> chunks;
+      for (size_t s = 0; s < sections.size(); s++) {
+        splitSection(s, sections[s], chunks);
+      }
+
+      vector<unique_ptr<ColumnBatch> > batches(chunks.size());
+      std::atomic<size_t> next(0);
+      auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < chunks.size()) {
+          const TableSection& section = sections[chunks[i].section];
+          batches[i].reset(new ColumnBatch(section.schema, section.required));
+          batches[i]->appendRows(chunks[i].begin, chunks[i].end, scanner);
+        }
+      };
+
+      vector<std::thread> threads;
+      for (int t = 1; t < numThreads && t < (int) chunks.size(); t++) {
+        threads.push_back(std::thread(worker));
+      }
+      worker();
+      for (auto& t : threads) {
+        t.join();
+      }
+
+      size_t numLines = 3 * sections.size();
+      size_t c = 0;
+      for (size_t s = 0; s < sections.size(); s++) {
+        engine.beginTable(sections[s].schema);
+        for (; c < chunks.size() && chunks[c].section == s; c++) {
+          engine.appendRows(*batches[c]);
+          numLines += batches[c]->numRows;
+          batches[c].reset();
+        }
+      }
+      engine.finishLoad();
+      return numLines;
+    }
+
+  private:
+
+    // Rows smaller than this are not worth a separate chunk
+    static const size_t MIN_CHUNK_BYTES = 1 << 16;
+
+    struct TableSection {
+      TableSchema schema;
+      vector<bool> required;
+      const char* rowsBegin;
+      const char* rowsEnd;
+    };
+
+    struct Chunk {
+      size_t section;
+      const char* begin;
+      const char* end;
+    };
+
+    int numThreads;
+    CsvScanner scanner;
+
+    vector<TableSection> findSections(const char* buf, const char* end) const {
+      vector<TableSection> sections;
+      const char* p = buf;
+      while (true) {
+        TableSection section;
+        const char* rowsEnd;
+        const char* rows = next_table_section(p, end, rowsEnd, section.schema);
+        if (sections.empty()) {
+          // Rows before the first table have nowhere to go
+          assert(rowsEnd == buf);
+        } else {
+          sections.back().rowsEnd = rowsEnd;
+        }
+        if (rows == nullptr) {
+          // No header may be cut short by the end of the input
+          assert(rowsEnd == end);
+          break;
+        }
+        section.rowsBegin = rows;
+        section.rowsEnd = end;
+        sections.push_back(section);
+
+        p = rows;
+      }
+      return sections;
+    }
+
+    void splitSection(const size_t s, const TableSection& section, vector<Chunk>& chunks) const {
+      size_t bytes = section.rowsEnd - section.rowsBegin;
+      size_t chunkBytes = bytes / (4 * numThreads) + 1;
+      if (chunkBytes < MIN_CHUNK_BYTES) {
+        chunkBytes = MIN_CHUNK_BYTES;
+      }
+
+      const char* p = section.rowsBegin;
+      while (p < section.rowsEnd) {
+        const char* chunkEnd = section.rowsEnd;
+        if ((size_t) (section.rowsEnd - p) > chunkBytes) {
+          chunkEnd = next_line(p + chunkBytes - 1, section.rowsEnd);
+        }
+        chunks.push_back(Chunk{s, p, chunkEnd});
+        p = chunkEnd;
+      }
+    }
+};
+
+// -------------------------------------------------
+// Single threaded loader that streams the input
+// through a fixed size buffer. Every buffer of
+// complete lines is parsed into one ColumnBatch and
+// handed to the engine before the buffer is reused,
+// so peak memory is the buffer, one batch, and
+// whatever the engine keeps.
+// -------------------------------------------------
+class StreamingCsvLoader {
+  public:
+
+    StreamingCsvLoader(const size_t bufferBytes_ = 1 << 22,
+        const CsvScanner scanner_ = SCANNER_MEMCHR) :
+      bufferBytes(bufferBytes_), scanner(scanner_) {}
+
+    // Returns the number of lines loaded
+    size_t load(std::istream& in, QueryEngine& engine) {
+      vector<char> buf(bufferBytes);
+      size_t filled = 0;
+      numLines = 0;
+
+      bool eof = false;
+      while (!eof) {
+        in.read(buf.data() + filled, buf.size() - filled);
+        filled += in.gcount();
+        eof = !in;
+
+        // Only complete lines are parsed, the rest is carried over
+        size_t complete = filled;
+        while (complete > 0 && buf[complete - 1] != '\n') {
+          complete--;
+        }
+
+        const char* consumed = consume(buf.data(), buf.data() + complete, engine);
+        size_t used = consumed - buf.data();
+        if (eof) {
+          // A <TABLE> header cut short by the end of the file
+          assert(used == complete);
+        } else if (used == 0 && filled == buf.size()) {
+          // A single line or header longer than the whole buffer
+          buf.resize(2 * buf.size());
+        }
+
+        memmove(buf.data(), buf.data() + used, filled - used);
+        filled -= used;
+      }
+
+      engine.finishLoad();
+      batch.reset();
+      schema.reset();
+      return numLines;
+    }
+
+  private:
+
+    size_t bufferBytes;
+    CsvScanner scanner;
+
+    size_t numLines;
+    std::unique_ptr<TableSchema> schema;
+    std::unique_ptr<ColumnBatch> batch;
+
+    // Parses the complete lines in [p, end) and returns where it
+    // stopped, which is end unless a header runs past it
+    const char* consume(const char* p, const char* end, QueryEngine& engine) {
+      while (p < end) {
+        TableSchema next;
+        const char* rowsEnd;
+        const char* rows = next_table_section(p, end, rowsEnd, next);
+        if (rowsEnd > p) {
+          // Rows before the first table have nowhere to go
+          assert(batch != nullptr);
+          batch->appendRows(p, rowsEnd, scanner);
+          p = rowsEnd;
+        }
+        if (rows == nullptr) {
+          break;
+        }
+
+        flush(engine);
+
+        schema.reset(new TableSchema(next));
+        engine.beginTable(*schema);
+        batch.reset(new ColumnBatch(*schema, engine.requiredColumns(*schema)));
+        numLines += 3;
+
+        p = rows;
+      }
+
+      // The batch points into the buffer, so it goes out before the next read
+      flush(engine);
+      return p;
+    }
+
+    void flush(QueryEngine& engine) {
+      if (batch != nullptr && batch->numRows > 0) {
+        engine.appendRows(*batch);
+        numLines += batch->numRows;
+        batch->clear();
+      }
+    }
+};
+
+// -------------------------------------------------
+// Read-only view of a contiguous array that lives
+// elsewhere, e.g. in a memory mapped snapshot
+// -------------------------------------------------
+template <typename T>
+class ArrayRef {
+  public:
+
+    const T* data;
+    size_t size;
+
+    ArrayRef() : data(nullptr), size(0) {}
+    ArrayRef(const T* data_, const size_t size_) : data(data_), size(size_) {}
+    ArrayRef(const vector<T>& v) : data(v.data()), size(v.size()) {}
+
+    const T* begin() const { return data; }
+    const T* end() const { return data + size; }
+
+    const T& operator[](const size_t i) const { return data[i]; }
+};
+
+// Checks that offsets is a valid CSR offset array for numRows rows
+// over numValues values
+static inline
+bool valid_offsets(const ArrayRef<uint64_t>& offsets, const size_t numRows, const size_t numValues) {
+  if (offsets.size != numRows + 1 || offsets[0] != 0 || offsets[numRows] != numValues) {
+    return false;
+  }
+  for (size_t i = 0; i < numRows; i++) {
+    if (offsets[i] > offsets[i + 1]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// FNV-1a, then a final mix so the low and high bits
+// both vary, as FlatIdTable needs
+static inline
+uint64_t hash_string(const StringRef& s) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < s.size; i++) {
+    h = (h ^ (unsigned char) s.data[i]) * 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  return h ^ (h >> 33);
+}
+
+// -------------------------------------------------
+// Open addressing hash table of uint32_t ids,
+// without deletion. Slots come in groups of 16, each
+// with a control byte holding 7 bits of the key's
+// hash, or EMPTY. A lookup compares the 16 control
+// bytes of a group at once (with SSE2 where
+// available) and only compares keys whose hash bits
+// match, so it mostly touches one group of control
+// bytes and one slot.
+// Ids stand for keys stored elsewhere, which the
+// caller hashes and compares, e.g. the names of a
+// StringDictionary. Full hashes are stored, so
+// growing never rehashes a key. Slots hold no
+// pointers or padding, so a table can be written out
+// byte for byte and adopted in place, e.g. from a
+// mapped snapshot; it is read-only then.
+// -------------------------------------------------
+class FlatIdTable {
+  public:
+
+    struct Slot {
+      uint64_t hash;
+      uint32_t id;
+      // Always 0
+      uint32_t reserved;
+    };
+
+    FlatIdTable() : numFull(0), groupMask(0) {
+      allocate(1);
+    }
+
+    size_t size() const { return numFull; }
+
+    // hash is the hash of the key looked for, and equal(id) says
+    // whether the key of a stored id is that key
+    template <typename Equal>
+    const Slot* find(const uint64_t hash, Equal equal) const {
+      for (uint64_t g = hash >> 7, step = 0; ; g += ++step) {
+        g &= groupMask;
+        uint32_t candidates = match(g, h2(hash));
+        while (candidates != 0) {
+          const Slot& slot = slotsRef[g * GROUP + __builtin_ctz(candidates)];
+          if (slot.hash == hash && equal(slot.id)) {
+            return &slot;
+          }
+          candidates &= candidates - 1;
+        }
+        if (match(g, EMPTY) != 0) {
+          return nullptr;
+        }
+      }
+    }
+
+    // Inserts the id of a key that is not present, with hash as in find()
+    void insert(const uint64_t hash, const uint32_t id) {
+      assert(!adopted());
+      if ((numFull + 1) * 8 > ownedSlots.size() * 7) {
+        grow();
+      }
+      place(hash).id = id;
+      numFull++;
+    }
+
+    const ArrayRef<int8_t>& controlBytes() const { return ctrlRef; }
+    const ArrayRef<Slot>& slots() const { return slotsRef; }
+
+    // Whether slots()[i] holds an id
+    bool full(const size_t i) const { return ctrlRef[i] != EMPTY; }
+
+    // Uses control bytes and slots written from controlBytes() and slots()
+    // in place. Fails unless they form a table of numFull ids with room
+    // left, which every probe sequence reaches. The ids are not checked.
+    bool adopt(const size_t numFull_, const ArrayRef<int8_t>& ctrl, const ArrayRef<Slot>& slots_) {
+      size_t numGroups = ctrl.size / GROUP;
+      if (ctrl.size == 0 || ctrl.size % GROUP != 0 || (numGroups & (numGroups - 1)) != 0 ||
+          slots_.size != ctrl.size || numFull_ >= ctrl.size) {
+        return false;
+      }
+      size_t full = 0;
+      for (auto c : ctrl) {
+        full += c != EMPTY;
+      }
+      if (full != numFull_) {
+        return false;
+      }
+      vector<int8_t>().swap(ownedCtrl);
+      vector<Slot>().swap(ownedSlots);
+      ctrlRef = ctrl;
+      slotsRef = slots_;
+      numFull = numFull_;
+      groupMask = numGroups - 1;
+      return true;
+    }
+
+  private:
+
+    static const size_t GROUP = 16;
+    static const int8_t EMPTY = -128;
+
+    vector<int8_t> ownedCtrl;
+    vector<Slot> ownedSlots;
+    ArrayRef<int8_t> ctrlRef;
+    ArrayRef<Slot> slotsRef;
+    size_t numFull;
+    uint64_t groupMask;
+
+    bool adopted() const { return ctrlRef.data != ownedCtrl.data(); }
+
+    static int8_t h2(const uint64_t h) { return h & 0x7f; }
+
+    // Bit i is set if control byte i of group g equals c
+    uint32_t match(const uint64_t g, const int8_t c) const {
+      const int8_t* group = ctrlRef.data + g * GROUP;
+#if defined(__SSE2__)
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+      return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)));
+#else
+      uint32_t bits = 0;
+      for (size_t i = 0; i < GROUP; i++) {
+        bits |= uint32_t(group[i] == c) << i;
+      }
+      return bits;
+#endif
+    }
+
+    void allocate(const size_t numGroups) {
+      ownedCtrl.assign(numGroups * GROUP, int8_t(EMPTY));
+      ownedSlots.assign(numGroups * GROUP, Slot{0, 0, 0});
+      ctrlRef = ArrayRef<int8_t>(ownedCtrl);
+      slotsRef = ArrayRef<Slot>(ownedSlots);
+      groupMask = numGroups - 1;
+    }
+
+    // Claims the first empty slot on the probe sequence of hash h
+    Slot& place(const uint64_t h) {
+      for (uint64_t g = h >> 7, step = 0; ; g += ++step) {
+        g &= groupMask;
+        uint32_t empty = match(g, EMPTY);
+        if (empty != 0) {
+          size_t i = g * GROUP + __builtin_ctz(empty);
+          ownedCtrl[i] = h2(h);
+          ownedSlots[i].hash = h;
+          return ownedSlots[i];
+        }
+      }
+    }
+
+    void grow() {
+      vector<int8_t> oldCtrl;
+      vector<Slot> oldSlots;
+      oldCtrl.swap(ownedCtrl);
+      oldSlots.swap(ownedSlots);
+      allocate(2 * (groupMask + 1));
+      for (size_t i = 0; i < oldSlots.size(); i++) {
+        if (oldCtrl[i] != EMPTY) {
+          place(oldSlots[i].hash).id = oldSlots[i].id;
+        }
+      }
+    }
+};
+
+// -------------------------------------------------
+// Interns strings as dense uint32_t ids, numbered in
+// order of first appearance. The interned bytes live
+// in the given arena. The hash table holds ids, not
+// strings, so it holds no pointers, and a snapshot's
+// table and names can be adopted in place; the
+// dictionary is read-only then.
+// -------------------------------------------------
+class StringDictionary {
+  public:
+
+    StringDictionary(Arena& arena_) : arena(arena_) {}
+
+    uint32_t intern(const StringRef& s) {
+      assert(nameOffsets.size == 0);
+      uint64_t h = hash_string(s);
+      const FlatIdTable::Slot* found = ids.find(h, NameIs(*this, s));
+      if (found != nullptr) {
+        return found->id;
+      }
+      uint32_t id = names.size();
+      names.push_back(arena.copy(s));
+      ids.insert(h, id);
+      return id;
+    }
+
+    // Returns false if s was never interned
+    bool find(const StringRef& s, uint32_t& id) const {
+      const FlatIdTable::Slot* found = ids.find(hash_string(s), NameIs(*this, s));
+      if (found == nullptr) {
+        return false;
+      }
+      id = found->id;
+      return true;
+    }
+
+    StringRef name(const uint32_t id) const {
+      assert(id < size());
+      if (nameOffsets.size > 0) {
+        return StringRef(nameBytes.data + nameOffsets[id], nameOffsets[id + 1] - nameOffsets[id]);
+      }
+      return names[id];
+    }
+
+    size_t size() const { return nameOffsets.size > 0 ? nameOffsets.size - 1 : names.size(); }
+
+    const FlatIdTable& table() const { return ids; }
+
+    // Uses the names, as CSR style offsets into bytes, and a table written
+    // from table() in place. Fails unless the table has one slot per name
+    // and every id in it is a valid one.
+    bool adopt(const ArrayRef<uint64_t>& offsets, const ArrayRef<char>& bytes,
+        const ArrayRef<int8_t>& ctrl, const ArrayRef<FlatIdTable::Slot>& slots) {
+      if (offsets.size == 0 || !valid_offsets(offsets, offsets.size - 1, bytes.size) ||
+          !ids.adopt(offsets.size - 1, ctrl, slots)) {
+        return false;
+      }
+      vector<bool> seen(offsets.size - 1, false);
+      for (size_t i = 0; i < slots.size; i++) {
+        if (ids.full(i)) {
+          uint32_t id = slots[i].id;
+          if (id >= seen.size() || seen[id]) {
+            return false;
+          }
+          seen[id] = true;
+        }
+      }
+      vector<StringRef>().swap(names);
+      nameOffsets = offsets;
+      nameBytes = bytes;
+      return true;
+    }
+
+  private:
+
+    struct NameIs {
+      const StringDictionary& dictionary;
+      const StringRef& s;
+
+      NameIs(const StringDictionary& dictionary_, const StringRef& s_) : dictionary(dictionary_), s(s_) {}
+
+      bool operator()(const uint32_t id) const { return dictionary.name(id) == s; }
+    };
+
+    Arena& arena;
+    FlatIdTable ids;
+    vector<StringRef> names;
+    // The names of an adopted dictionary
+    ArrayRef<uint64_t> nameOffsets;
+    ArrayRef<char> nameBytes;
+};
+
+// -------------------------------------------------
+// Binary snapshot files. A snapshot is a header, a
+// table of sections, and the section payloads, each
+// aligned to 64 bytes so a mapped file can be used
+// in place as typed arrays. Integers and floats are
+// stored in native byte order.
+// -------------------------------------------------
+static const char SNAPSHOT_MAGIC[8] = {'F', 'A', 'K', 'E', 'D', 'B', 'S', 'N'};
+static const uint32_t SNAPSHOT_VERSION = 5;
+static const uint64_t SNAPSHOT_ALIGNMENT = 64;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t numSections;
+  // Number of lines in the CSV file the snapshot was made from
+  uint64_t numLines;
+};
+
+struct SnapshotSectionEntry {
+  uint32_t tag;
+  uint32_t elementSize;
+  uint64_t offset;
+  uint64_t bytes;
+};
+
+class SnapshotWriter {
+  public:
+
+    // The data is not copied and must stay alive until write()
+    template <typename T>
+    void add(const uint32_t tag, const T* data, const size_t count) {
+      sections.push_back(Section{tag, sizeof(T), reinterpret_cast<const char*>(data), count * sizeof(T)});
+    }
+
+    template <typename T>
+    void add(const uint32_t tag, const vector<T>& v) {
+      add(tag, v.data(), v.size());
+    }
+
+    // Takes a vector that is only made to be written, and keeps it
+    // until the writer goes away
+    template <typename T>
+    void add(const uint32_t tag, vector<T>&& v) {
+      std::shared_ptr<vector<T> > kept(new vector<T>());
+      kept->swap(v);
+      keptData.push_back(kept);
+      add(tag, kept->data(), kept->size());
+    }
+
+    template <typename T>
+    void add(const uint32_t tag, const ArrayRef<T>& a) {
+      add(tag, a.data, a.size);
+    }
+
+    void add(const uint32_t tag, const std::string& s) {
+      add(tag, s.data(), s.size());
+    }
+
+    bool write(const std::string& path, const uint64_t numLines) const {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+      SnapshotHeader header;
+      memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+      header.version = SNAPSHOT_VERSION;
+      header.numSections = sections.size();
+      header.numLines = numLines;
+      out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+      uint64_t offset = align(sizeof(header) + sections.size() * sizeof(SnapshotSectionEntry));
+      for (auto& s : sections) {
+        SnapshotSectionEntry entry = {s.tag, s.elementSize, offset, s.bytes};
+        out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        offset = align(offset + s.bytes);
+      }
+
+      uint64_t pos = sizeof(header) + sections.size() * sizeof(SnapshotSectionEntry);
+      for (auto& s : sections) {
+        pad(out, pos);
+        out.write(s.data, s.bytes);
+        pos += s.bytes;
+      }
+      pad(out, pos);
+
+      return out.good();
+    }
+
+  private:
+
+    struct Section {
+      uint32_t tag;
+      uint32_t elementSize;
+      const char* data;
+      uint64_t bytes;
+    };
+
+    vector<Section> sections;
+    vector<std::shared_ptr<void> > keptData;
+
+    static uint64_t align(const uint64_t offset) {
+      return (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    }
+
+    static void pad(std::ostream& out, uint64_t& pos) {
+      static const char zeros[SNAPSHOT_ALIGNMENT] = {0};
+      out.write(zeros, align(pos) - pos);
+      pos = align(pos);
+    }
+};
+
+class SnapshotReader {
+  public:
+
+    SnapshotReader(const char* data_, const size_t size_) : data(data_), size(size_) {}
+
+    // Checks the header and that every section lies inside the file
+    bool valid() const {
+      if (size < sizeof(SnapshotHeader) ||
+          memcmp(header().magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+          header().version != SNAPSHOT_VERSION ||
+          header().numSections > (size - sizeof(SnapshotHeader)) / sizeof(SnapshotSectionEntry)) {
+        return false;
+      }
+      for (uint32_t i = 0; i < header().numSections; i++) {
+        const SnapshotSectionEntry& e = entry(i);
+        if (e.offset % SNAPSHOT_ALIGNMENT != 0 || e.offset > size || e.bytes > size - e.offset) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    uint64_t numLines() const { return header().numLines; }
+
+    bool has(const uint32_t tag) const {
+      for (uint32_t i = 0; i < header().numSections; i++) {
+        if (entry(i).tag == tag) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Points out at the section with the given tag. Fails if there is no
+    // such section or it was not written as an array of T.
+    template <typename T>
+    bool section(const uint32_t tag, ArrayRef<T>& out) const {
+      for (uint32_t i = 0; i < header().numSections; i++) {
+        const SnapshotSectionEntry& e = entry(i);
+        if (e.tag == tag) {
+          if (e.elementSize != sizeof(T)) {
+            return false;
+          }
+          out = ArrayRef<T>(reinterpret_cast<const T*>(data + e.offset), e.bytes / sizeof(T));
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+
+    const char* data;
+    size_t size;
+
+    const SnapshotHeader& header() const {
+      return *reinterpret_cast<const SnapshotHeader*>(data);
+    }
+
+    const SnapshotSectionEntry& entry(const uint32_t i) const {
+      return reinterpret_cast<const SnapshotSectionEntry*>(data + sizeof(SnapshotHeader))[i];
+    }
+};
+
+// Sections of a ReferenceQueryEngine snapshot. Assets are numbered
+// by their dictionary id, and the per-asset series are stored CSR style:
+// asset a owns days/values [offsets[a], offsets[a + 1]). Trades are
+// stored the same way, as the days an asset traded on and the number
+// of trades on each, followed by their running counts. The dictionary
+// hash tables and the hybrid series indexes are stored as built, so
+// that all of them are used in place. The hybrid indexes are only there
+// in snapshots written with them, and then hold the dense series, which
+// are empty in the CSR sections.
+enum SnapshotSectionTag {
+  SNAPSHOT_SCHEMAS = 1,
+  SNAPSHOT_ASSET_NAME_OFFSETS,
+  SNAPSHOT_ASSET_NAMES,
+  SNAPSHOT_CLASS_NAME_OFFSETS,
+  SNAPSHOT_CLASS_NAMES,
+  SNAPSHOT_ASSET_CLASSES,
+  SNAPSHOT_TRADABLE_IDS,
+  SNAPSHOT_PRICE_OFFSETS,
+  SNAPSHOT_PRICE_DAYS,
+  SNAPSHOT_PRICES,
+  SNAPSHOT_VOLUME_OFFSETS,
+  SNAPSHOT_VOLUME_DAYS,
+  SNAPSHOT_VOLUMES,
+  SNAPSHOT_TRADE_DAY_OFFSETS,
+  SNAPSHOT_TRADE_DAYS,
+  SNAPSHOT_TRADE_DAY_COUNTS,
+  SNAPSHOT_TRADE_RUNNING_COUNTS,
+  SNAPSHOT_TRADE_DENSE_COUNTS,
+  SNAPSHOT_TRADE_DENSE_RUNNING_COUNTS,
+  SNAPSHOT_ASSET_TABLE_CONTROL,
+  SNAPSHOT_ASSET_TABLE_SLOTS,
+  SNAPSHOT_CLASS_TABLE_CONTROL,
+  SNAPSHOT_CLASS_TABLE_SLOTS,
+  SNAPSHOT_PRICE_FORMATS,
+  SNAPSHOT_PRICE_DENSE_VALUES,
+  SNAPSHOT_PRICE_PRESENCE,
+  SNAPSHOT_VOLUME_FORMATS,
+  SNAPSHOT_VOLUME_DENSE_VALUES,
+  SNAPSHOT_VOLUME_PRESENCE
+};
+
+// Asset class of an asset that is not in the tradable table
+static const uint32_t SNAPSHOT_NO_CLASS = 0xffffffff;
+
+// Sections of one per-asset series, and of its hybrid index
+struct SeriesSectionTags {
+  uint32_t offsets, days, values;
+  uint32_t formats, denseValues, presence;
+};
+
+static const SeriesSectionTags SNAPSHOT_PRICE_SECTIONS = {
+  SNAPSHOT_PRICE_OFFSETS, SNAPSHOT_PRICE_DAYS, SNAPSHOT_PRICES,
+  SNAPSHOT_PRICE_FORMATS, SNAPSHOT_PRICE_DENSE_VALUES, SNAPSHOT_PRICE_PRESENCE
+};
+
+static const SeriesSectionTags SNAPSHOT_VOLUME_SECTIONS = {
+  SNAPSHOT_VOLUME_OFFSETS, SNAPSHOT_VOLUME_DAYS, SNAPSHOT_VOLUMES,
+  SNAPSHOT_VOLUME_FORMATS, SNAPSHOT_VOLUME_DENSE_VALUES, SNAPSHOT_VOLUME_PRESENCE
+};
+
+// -------------------------------------------------
+// Per-asset time series in compressed sparse row
+// form. Series a is days/values [offsets[a],
+// offsets[a + 1]), sorted by day with at most one
+// value per day. Rows are staged during the load
+// and turned into the CSR arrays by build(); a
+// snapshot's arrays can be adopted in place instead.
+// -------------------------------------------------
+class SeriesCsr {
+  public:
+
+    void stage(const uint32_t series, const int32_t day, const float value) {
+      stagedSeries.push_back(series);
+      stagedDays.push_back(day);
+      stagedValues.push_back(value);
+    }
+
+    // Builds numSeries series from the staged rows. When a series has
+    // several rows for one day, the first one staged wins.
+    void build(const size_t numSeries) {
+      vector<uint64_t> offsets(numSeries + 1, 0);
+      for (auto s : stagedSeries) {
+        assert(s < numSeries);
+        offsets[s + 1]++;
+      }
+      for (size_t s = 0; s < numSeries; s++) {
+        offsets[s + 1] += offsets[s];
+      }
+
+      // Counting sort by series keeps the staging order within a series
+      vector<int32_t> days(stagedDays.size());
+      vector<float> values(stagedValues.size());
+      vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+      for (size_t i = 0; i < stagedSeries.size(); i++) {
+        uint64_t p = next[stagedSeries[i]]++;
+        days[p] = stagedDays[i];
+        values[p] = stagedValues[i];
+      }
+      vector<uint32_t>().swap(stagedSeries);
+      vector<int32_t>().swap(stagedDays);
+      vector<float>().swap(stagedValues);
+
+      // Sort every series by day and compact it in place
+      vector<pair<int32_t, float> > rows;
+      uint64_t out = 0;
+      for (size_t s = 0; s < numSeries; s++) {
+        uint64_t begin = offsets[s], end = offsets[s + 1];
+        offsets[s] = out;
+        if (!std::is_sorted(days.begin() + begin, days.begin() + end)) {
+          rows.clear();
+          for (uint64_t i = begin; i < end; i++) {
+            rows.push_back({days[i], values[i]});
+          }
+          std::stable_sort(rows.begin(), rows.end(),
+              [](const pair<int32_t, float>& a, const pair<int32_t, float>& b) { return a.first < b.first; });
+          for (uint64_t i = begin; i < end; i++) {
+            days[i] = rows[i - begin].first;
+            values[i] = rows[i - begin].second;
+          }
+        }
+        for (uint64_t i = begin; i < end; i++) {
+          if (i == begin || days[i] != days[i - 1]) {
+            days[out] = days[i];
+            values[out] = values[i];
+            out++;
+          }
+        }
+      }
+      offsets[numSeries] = out;
+      days.resize(out);
+      values.resize(out);
+      assign(offsets, days, values);
+    }
+
+    // Takes the contents of the vectors, which must form valid series,
+    // as the series. The vectors are left empty.
+    void assign(vector<uint64_t>& offsets, vector<int32_t>& days, vector<float>& values) {
+      ownedOffsets.swap(offsets);
+      ownedDays.swap(days);
+      ownedValues.swap(values);
+      vector<uint64_t>().swap(offsets);
+      vector<int32_t>().swap(days);
+      vector<float>().swap(values);
+      offsetsRef = ArrayRef<uint64_t>(ownedOffsets);
+      daysRef = ArrayRef<int32_t>(ownedDays);
+      valuesRef = ArrayRef<float>(ownedValues);
+    }
+
+    // Uses arrays that live elsewhere, e.g. in a mapped snapshot, as the
+    // series. Fails unless they form numSeries valid series.
+    bool adopt(const size_t numSeries, const ArrayRef<uint64_t>& offsets,
+        const ArrayRef<int32_t>& days, const ArrayRef<float>& values) {
+      if (!valid_offsets(offsets, numSeries, days.size) || values.size != days.size) {
+        return false;
+      }
+      for (size_t s = 0; s < numSeries; s++) {
+        for (uint64_t i = offsets[s] + 1; i < offsets[s + 1]; i++) {
+          if (days[i - 1] >= days[i]) {
+            return false;
+          }
+        }
+      }
+      offsetsRef = offsets;
+      daysRef = days;
+      valuesRef = values;
+      return true;
+    }
+
+    size_t numSeries() const { return offsetsRef.size == 0 ? 0 : offsetsRef.size - 1; }
+
+    bool empty(const uint32_t series) const { return begin(series) == end(series); }
+
+    // Bounds of a series in days() and values()
+    uint64_t begin(const uint32_t series) const { return offsetsRef[series]; }
+    uint64_t end(const uint32_t series) const { return offsetsRef[series + 1]; }
+
+    // Position of the first day of the series that is not before day
+    uint64_t lowerBound(const uint32_t series, const int32_t day) const {
+      return std::lower_bound(daysRef.data + begin(series), daysRef.data + end(series), day) - daysRef.data;
+    }
+
+    // Position of the first day of the series that is after day
+    uint64_t upperBound(const uint32_t series, const int32_t day) const {
+      return std::upper_bound(daysRef.data + begin(series), daysRef.data + end(series), day) - daysRef.data;
+    }
+
+    const ArrayRef<uint64_t>& offsets() const { return offsetsRef; }
+    const ArrayRef<int32_t>& days() const { return daysRef; }
+    const ArrayRef<float>& values() const { return valuesRef; }
+
+    // Frees the values once a copy of them exists elsewhere, e.g. a
+    // compressed one. values() is empty afterwards.
+    void releaseValues() {
+      vector<float>().swap(ownedValues);
+      valuesRef = ArrayRef<float>();
+    }
+
+    // The same for the days. lowerBound() and upperBound() can no
+    // longer be used afterwards.
+    void releaseDays() {
+      vector<int32_t>().swap(ownedDays);
+      daysRef = ArrayRef<int32_t>();
+    }
+
+    // Empties the series s with cleared[s] set, once their rows are kept
+    // elsewhere. The remaining rows are copied into owned arrays.
+    void clearSeries(const vector<bool>& cleared) {
+      assert(cleared.size() == numSeries());
+      vector<uint64_t> offsets(1, 0);
+      vector<int32_t> days;
+      vector<float> values;
+      for (uint32_t s = 0; s < numSeries(); s++) {
+        if (!cleared[s]) {
+          days.insert(days.end(), daysRef.data + begin(s), daysRef.data + end(s));
+          values.insert(values.end(), valuesRef.data + begin(s), valuesRef.data + end(s));
+        }
+        offsets.push_back(days.size());
+      }
+      assign(offsets, days, values);
+    }
+
+  private:
+
+    vector<uint32_t> stagedSeries;
+    vector<int32_t> stagedDays;
+    vector<float> stagedValues;
+
+    vector<uint64_t> ownedOffsets;
+    vector<int32_t> ownedDays;
+    vector<float> ownedValues;
+
+    ArrayRef<uint64_t> offsetsRef;
+    ArrayRef<int32_t> daysRef;
+    ArrayRef<float> valuesRef;
+};
+
+// -------------------------------------------------
+// Trade counts per asset, in total and per day. The
+// days an asset traded on are kept CSR style with
+// the number of trades on each and a running count,
+// so the trades in any day window are a difference
+// of two running counts found by binary search.
+// Assets that traded on most days of their span also
+// get a running count for every day of it, which
+// answers a window with no search at all. All the
+// arrays can be written out and adopted in place.
+// -------------------------------------------------
+class TradeAggregate {
+  public:
+
+    // An asset's dense running counts: entry k counts its trades on the
+    // days before firstDay + k, for k in [0, days]. No dense counts if
+    // days is 0.
+    struct Dense {
+      int64_t firstDay = 0;
+      uint64_t days = 0;
+      uint64_t offset = 0;
+    };
+
+    void stage(const uint32_t asset, const int32_t day) {
+      stagedAssets.push_back(asset);
+      stagedDays.push_back(day);
+    }
+
+    // Builds the counts of numAssets assets from the staged trades
+    void build(const size_t numAssets) {
+      vector<uint64_t> starts(numAssets + 1, 0);
+      for (auto a : stagedAssets) {
+        assert(a < numAssets);
+        starts[a + 1]++;
+      }
+      for (size_t a = 0; a < numAssets; a++) {
+        starts[a + 1] += starts[a];
+      }
+      vector<int32_t> sorted(stagedDays.size());
+      vector<uint64_t> next(starts.begin(), starts.end() - 1);
+      for (size_t i = 0; i < stagedAssets.size(); i++) {
+        sorted[next[stagedAssets[i]]++] = stagedDays[i];
+      }
+      vector<uint32_t>().swap(stagedAssets);
+      vector<int32_t>().swap(stagedDays);
+
+      ownedOffsets.assign(1, 0);
+      ownedDays.clear();
+      ownedDayCounts.clear();
+      for (size_t a = 0; a < numAssets; a++) {
+        std::sort(sorted.begin() + starts[a], sorted.begin() + starts[a + 1]);
+        for (uint64_t i = starts[a]; i < starts[a + 1]; i++) {
+          if (i == starts[a] || sorted[i] != sorted[i - 1]) {
+            ownedDays.push_back(sorted[i]);
+            ownedDayCounts.push_back(0);
+          }
+          ownedDayCounts.back()++;
+        }
+        ownedOffsets.push_back(ownedDays.size());
+      }
+      index();
+      offsets = ArrayRef<uint64_t>(ownedOffsets);
+      days = ArrayRef<int32_t>(ownedDays);
+      dayCounts = ArrayRef<uint32_t>(ownedDayCounts);
+      running = ArrayRef<uint64_t>(ownedRunning);
+      denseAssets = ArrayRef<Dense>(ownedDenseAssets);
+      denseRunning = ArrayRef<uint64_t>(ownedDenseRunning);
+    }
+
+    // Uses arrays as written from the accessors below in place. Fails
+    // unless they are valid for numAssets assets; only their sizes and
+    // the order of the days are checked, not the counts.
+    bool adopt(const size_t numAssets, const ArrayRef<uint64_t>& offsets_,
+        const ArrayRef<int32_t>& days_, const ArrayRef<uint32_t>& dayCounts_,
+        const ArrayRef<uint64_t>& running_, const ArrayRef<Dense>& denseAssets_,
+        const ArrayRef<uint64_t>& denseRunning_) {
+      if (!valid_offsets(offsets_, numAssets, days_.size) || dayCounts_.size != days_.size ||
+          running_.size != days_.size || denseAssets_.size != numAssets) {
+        return false;
+      }
+      for (size_t a = 0; a < numAssets; a++) {
+        for (uint64_t i = offsets_[a] + 1; i < offsets_[a + 1]; i++) {
+          if (days_[i - 1] >= days_[i]) {
+            return false;
+          }
+        }
+        const Dense& dense = denseAssets_[a];
+        if (dense.days > 0 && (dense.offset > denseRunning_.size || dense.days >= denseRunning_.size - dense.offset)) {
+          return false;
+        }
+      }
+      offsets = offsets_;
+      days = days_;
+      dayCounts = dayCounts_;
+      running = running_;
+      denseAssets = denseAssets_;
+      denseRunning = denseRunning_;
+      return true;
+    }
+
+    uint64_t total(const uint32_t asset) const {
+      return offsets[asset] == offsets[asset + 1] ? 0 : running[offsets[asset + 1] - 1];
+    }
+
+    // Number of trades of the asset on the days [fromDay, toDay]
+    uint64_t count(const uint32_t asset, const int32_t fromDay, const int32_t toDay) const {
+      if (fromDay > toDay) {
+        return 0;
+      }
+      const Dense& dense = denseAssets[asset];
+      if (dense.days > 0) {
+        const uint64_t* perDay = denseRunning.data + dense.offset;
+        return perDay[slot(dense, (int64_t) toDay + 1)] - perDay[slot(dense, fromDay)];
+      }
+      uint64_t begin = offsets[asset], end = offsets[asset + 1];
+      uint64_t lo = std::lower_bound(days.data + begin, days.data + end, fromDay) - days.data;
+      uint64_t hi = std::upper_bound(days.data + begin, days.data + end, toDay) - days.data;
+      return (hi > begin ? running[hi - 1] : 0) - (lo > begin ? running[lo - 1] : 0);
+    }
+
+    const ArrayRef<uint64_t>& dayOffsets() const { return offsets; }
+    const ArrayRef<int32_t>& tradeDays() const { return days; }
+    const ArrayRef<uint32_t>& tradeDayCounts() const { return dayCounts; }
+    // Trades of the asset up to and including each day
+    const ArrayRef<uint64_t>& runningCounts() const { return running; }
+    const ArrayRef<Dense>& denseCounts() const { return denseAssets; }
+    const ArrayRef<uint64_t>& denseRunningCounts() const { return denseRunning; }
+
+  private:
+
+    vector<uint32_t> stagedAssets;
+    vector<int32_t> stagedDays;
+
+    vector<uint64_t> ownedOffsets;
+    vector<int32_t> ownedDays;
+    vector<uint32_t> ownedDayCounts;
+    vector<uint64_t> ownedRunning;
+    vector<Dense> ownedDenseAssets;
+    vector<uint64_t> ownedDenseRunning;
+
+    ArrayRef<uint64_t> offsets;
+    ArrayRef<int32_t> days;
+    ArrayRef<uint32_t> dayCounts;
+    ArrayRef<uint64_t> running;
+    ArrayRef<Dense> denseAssets;
+    ArrayRef<uint64_t> denseRunning;
+
+    static uint64_t slot(const Dense& dense, const int64_t day) {
+      int64_t k = day - dense.firstDay;
+      return k < 0 ? 0 : (uint64_t) k > dense.days ? dense.days : k;
+    }
+
+    // Fills the running and dense counts from the owned per-day counts
+    void index() {
+      size_t numAssets = ownedOffsets.size() - 1;
+      ownedRunning.assign(ownedDays.size(), 0);
+      ownedDenseAssets.assign(numAssets, Dense());
+      ownedDenseRunning.clear();
+      for (size_t a = 0; a < numAssets; a++) {
+        uint64_t begin = ownedOffsets[a], end = ownedOffsets[a + 1];
+        for (uint64_t i = begin; i < end; i++) {
+          ownedRunning[i] = (i > begin ? ownedRunning[i - 1] : 0) + ownedDayCounts[i];
+        }
+        if (begin == end) {
+          continue;
+        }
+        // Dense when at least a quarter of the days in the span had trades
+        uint64_t span = (uint64_t) ((int64_t) ownedDays[end - 1] - ownedDays[begin]) + 1;
+        if (span > 4 * (end - begin)) {
+          continue;
+        }
+        Dense& dense = ownedDenseAssets[a];
+        dense.firstDay = ownedDays[begin];
+        dense.days = span;
+        dense.offset = ownedDenseRunning.size();
+        ownedDenseRunning.push_back(0);
+        uint64_t i = begin;
+        for (uint64_t k = 0; k < span; k++) {
+          uint64_t today = 0;
+          if (i < end && (int64_t) ownedDays[i] - dense.firstDay == (int64_t) k) {
+            today = ownedDayCounts[i++];
+          }
+          ownedDenseRunning.push_back(ownedDenseRunning.back() + today);
+        }
+      }
+    }
+};
+
+// -------------------------------------------------
+// Index over the series of a SeriesCsr that answers
+// the range predicates of exe(). The engine holds
+// one for the prices and one for the volumes, of the
+// kind chosen by --series-index.
+// -------------------------------------------------
+class SeriesIndex {
+  public:
+
+    virtual ~SeriesIndex() {}
+
+    // Builds the index over csr, which must outlive it. Indexes that keep
+    // the values or days in a form of their own take them out of csr.
+    virtual void build(SeriesCsr& csr) = 0;
+
+    // Whether the series has any value
+    virtual bool hasAny(const uint32_t series) const = 0;
+
+    // Whether any value on the days [fromDay, toDay] is above / below threshold
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const = 0;
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const = 0;
+
+    // Adds the series, as the index left csr, to a snapshot. Values or
+    // days taken out of csr are written decoded.
+    virtual void save(SnapshotWriter& snapshot, const SeriesCsr& csr, const SeriesSectionTags& tags) const {
+      snapshot.add(tags.offsets, csr.offsets());
+      snapshot.add(tags.days, csr.days());
+      snapshot.add(tags.values, csr.values());
+    }
+};
+
+// -------------------------------------------------
+// Per-asset choice between two series formats,
+// made from the density of each series in a
+// SeriesCsr. Dense series are moved to a
+// day-indexed array with a presence bitmap and
+// emptied in the CSR; sparse ones are read as the
+// sorted (day, value) runs of the CSR, which must
+// outlive this index. The arrays of a built index
+// can be written out and adopted in place, next to
+// the CSR it left behind.
+// -------------------------------------------------
+class HybridSeries : public SeriesIndex {
+  public:
+
+    // A series becomes dense when it has at least MIN_DENSE_ROWS rows and
+    // they fill at least minDensity of the days between its first and last.
+    // At 1/2, its array takes at most about as much memory as its CSR runs.
+    static const uint64_t MIN_DENSE_ROWS = 32;
+
+    // Where and how a series is stored. dense is 0 or 1, and 32 bits wide
+    // so that the struct has no padding to write out.
+    struct Format {
+      uint32_t dense = 0;
+      int32_t firstDay = 0;
+      uint64_t numDays = 0;
+      uint64_t valueOffset = 0;
+      // In 64-bit words
+      uint64_t presenceOffset = 0;
+    };
+
+    explicit HybridSeries(const double minDensity_ = 0.5) : minDensity(minDensity_) {}
+
+    // Moves the dense series of csr_ out of it
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      vector<Format> formats(csr->numSeries(), Format());
+      vector<float> denseValues;
+      vector<uint64_t> presence;
+      vector<bool> dense(csr->numSeries(), false);
+
+      const int32_t* days = csr->days().data;
+      const float* values = csr->values().data;
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        uint64_t begin = csr->begin(s), end = csr->end(s);
+        if (end - begin < MIN_DENSE_ROWS) {
+          continue;
+        }
+        // Days are sorted and distinct, so the span fits in the CSR order
+        uint64_t span = (uint64_t) ((int64_t) days[end - 1] - days[begin]) + 1;
+        if (end - begin < minDensity * span) {
+          continue;
+        }
+        Format& f = formats[s];
+        dense[s] = true;
+        f.dense = 1;
+        f.firstDay = days[begin];
+        f.numDays = span;
+        f.valueOffset = denseValues.size();
+        f.presenceOffset = presence.size();
+        denseValues.resize(denseValues.size() + span, 0.0f);
+        presence.resize(presence.size() + (span + 63) / 64, 0);
+        for (uint64_t i = begin; i < end; i++) {
+          uint64_t slot = (uint64_t) ((int64_t) days[i] - f.firstDay);
+          denseValues[f.valueOffset + slot] = values[i];
+          presence[f.presenceOffset + slot / 64] |= uint64_t(1) << (slot % 64);
+        }
+      }
+      csr_.clearSeries(dense);
+      ownedFormats.swap(formats);
+      ownedDenseValues.swap(denseValues);
+      ownedPresence.swap(presence);
+      formatsRef = ArrayRef<Format>(ownedFormats);
+      denseValuesRef = ArrayRef<float>(ownedDenseValues);
+      presenceRef = ArrayRef<uint64_t>(ownedPresence);
+    }
+
+    // Uses the arrays that save() wrote for an index over the same CSR in
+    // place. Fails unless every dense series lies inside them and is empty
+    // in the CSR; the values themselves are not checked.
+    bool adopt(const SeriesCsr& csr_, const ArrayRef<Format>& formats_,
+        const ArrayRef<float>& denseValues_, const ArrayRef<uint64_t>& presence_) {
+      if (formats_.size != csr_.numSeries()) {
+        return false;
+      }
+      for (uint32_t s = 0; s < formats_.size; s++) {
+        const Format& f = formats_[s];
+        if (f.dense > 1 || (f.dense == 1 &&
+              (!csr_.empty(s) || f.numDays == 0 || f.numDays > (uint64_t) std::numeric_limits<uint32_t>::max() ||
+               f.valueOffset > denseValues_.size || f.numDays > denseValues_.size - f.valueOffset ||
+               f.presenceOffset > presence_.size || (f.numDays + 63) / 64 > presence_.size - f.presenceOffset))) {
+          return false;
+        }
+      }
+      csr = &csr_;
+      vector<Format>().swap(ownedFormats);
+      vector<float>().swap(ownedDenseValues);
+      vector<uint64_t>().swap(ownedPresence);
+      formatsRef = formats_;
+      denseValuesRef = denseValues_;
+      presenceRef = presence_;
+      return true;
+    }
+
+    size_t numSeries() const { return formatsRef.size; }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return formatsRef[series].dense || !csr->empty(series);
+    }
+
+
+    // Whether pred holds for the value of any day in [fromDay, toDay]
+    template <typename Pred>
+    bool any(const uint32_t series, const int32_t fromDay, const int32_t toDay, Pred pred) const {
+      const Format& f = formatsRef[series];
+      return f.dense ? anyDense(f, fromDay, toDay, pred) : anySparse(series, fromDay, toDay, pred);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any(series, fromDay, toDay, [threshold](const float v) { return v > threshold; });
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any(series, fromDay, toDay, [threshold](const float v) { return v < threshold; });
+    }
+
+    // The CSR without the dense series, and the arrays of this index
+    virtual void save(SnapshotWriter& snapshot, const SeriesCsr& csr_, const SeriesSectionTags& tags) const override {
+      SeriesIndex::save(snapshot, csr_, tags);
+      snapshot.add(tags.formats, formatsRef);
+      snapshot.add(tags.denseValues, denseValuesRef);
+      snapshot.add(tags.presence, presenceRef);
+    }
+
+    // Puts the dense series back between the sparse ones, as the arrays
+    // of a CSR holding every series
+    void decodeAll(vector<uint64_t>& offsets, vector<int32_t>& days, vector<float>& values) const {
+      offsets.assign(1, 0);
+      days.clear();
+      values.clear();
+      for (uint32_t s = 0; s < numSeries(); s++) {
+        const Format& f = formatsRef[s];
+        if (f.dense) {
+          for (uint64_t i = 0; i < f.numDays; i++) {
+            if (presenceRef[f.presenceOffset + i / 64] >> (i % 64) & 1) {
+              days.push_back(f.firstDay + (int32_t) i);
+              values.push_back(denseValuesRef[f.valueOffset + i]);
+            }
+          }
+        } else {
+          days.insert(days.end(), csr->days().data + csr->begin(s), csr->days().data + csr->end(s));
+          values.insert(values.end(), csr->values().data + csr->begin(s), csr->values().data + csr->end(s));
+        }
+        offsets.push_back(days.size());
+      }
+    }
+
+  private:
+
+    double minDensity;
+    const SeriesCsr* csr = nullptr;
+    vector<Format> ownedFormats;
+    vector<float> ownedDenseValues;
+    vector<uint64_t> ownedPresence;
+    ArrayRef<Format> formatsRef;
+    ArrayRef<float> denseValuesRef;
+    ArrayRef<uint64_t> presenceRef;
+
+    template <typename Pred>
+    bool anySparse(const uint32_t series, const int32_t fromDay, const int32_t toDay, Pred pred) const {
+      const int32_t* days = csr->days().data;
+      const float* values = csr->values().data;
+      for (uint64_t i = csr->lowerBound(series, fromDay), end = csr->end(series); i < end && days[i] <= toDay; i++) {
+        if (pred(values[i])) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Walks the presence bitmap a word at a time and only
+    // tests the days that have a value
+    template <typename Pred>
+    bool anyDense(const Format& f, const int32_t fromDay, const int32_t toDay, Pred pred) const {
+      int64_t lastDay = f.firstDay + (int64_t) f.numDays - 1;
+      if (toDay < f.firstDay || fromDay > lastDay) {
+        return false;
+      }
+      uint64_t first = (uint64_t) (max<int64_t>(fromDay, f.firstDay) - f.firstDay);
+      uint64_t last = (uint64_t) (min<int64_t>(toDay, lastDay) - f.firstDay);
+      const float* values = denseValuesRef.data + f.valueOffset;
+      const uint64_t* bits = presenceRef.data + f.presenceOffset;
+      for (uint64_t i = first; i <= last; ) {
+        uint64_t span = min<uint64_t>(64 - i % 64, last - i + 1);
+        uint64_t word = bits[i / 64] >> (i % 64);
+        if (span < 64) {
+          word &= (uint64_t(1) << span) - 1;
+        }
+        while (word != 0) {
+          if (pred(values[i + __builtin_ctzll(word)])) {
+            return true;
+          }
+          word &= word - 1;
+        }
+        i += span;
+      }
+      return false;
+    }
+};
+
+// Which extreme a range index keeps
+enum RangeKind {
+  RANGE_MAX,
+  RANGE_MIN
+};
+
+// Extreme of an empty range: -inf for RANGE_MAX, +inf for RANGE_MIN
+static inline
+float range_none(const RangeKind kind) {
+  return kind == RANGE_MAX ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+}
+
+static inline
+float range_combine(const RangeKind kind, const float a, const float b) {
+  return kind == RANGE_MAX ? max(a, b) : min(a, b);
+}
+
+// A value as a range index stores it. NaN becomes range_none(),
+// as no comparison holds for it.
+static inline
+float range_leaf(const RangeKind kind, const float value) {
+  return value != value ? range_none(kind) : value;
+}
+
+// -------------------------------------------------
+// Sparse table over the values of a SeriesCsr that
+// answers range max or range min over any day window
+// of a series with two lookups. Level k holds the
+// extreme of the 2^k values starting at each
+// position, so levels stop at the longest series.
+// A max index answers anyAbove() and a min index
+// anyBelow().
+// -------------------------------------------------
+class RangeExtremeIndex : public SeriesIndex {
+  public:
+
+    explicit RangeExtremeIndex(const RangeKind kind_) : kind(kind_) {}
+
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      levels.clear();
+
+      uint64_t longest = 0;
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        longest = max(longest, csr->end(s) - csr->begin(s));
+      }
+
+      const ArrayRef<float>& values = csr->values();
+      levels.push_back(vector<float>(values.size));
+      for (size_t i = 0; i < values.size; i++) {
+        levels[0][i] = range_leaf(kind, values[i]);
+      }
+      for (uint64_t width = 2; width <= longest; width *= 2) {
+        const vector<float>& prev = levels.back();
+        vector<float> level(values.size - width + 1);
+        for (size_t i = 0; i < level.size(); i++) {
+          level[i] = range_combine(kind, prev[i], prev[i + width / 2]);
+        }
+        levels.push_back(std::move(level));
+      }
+    }
+
+    // Largest (RANGE_MAX) or smallest (RANGE_MIN) value of the series on
+    // the days [fromDay, toDay]; -inf or +inf if there is none
+    float query(const uint32_t series, const int32_t fromDay, const int32_t toDay) const {
+      uint64_t begin = csr->lowerBound(series, fromDay);
+      uint64_t end = csr->upperBound(series, toDay);
+      if (begin >= end) {
+        return range_none(kind);
+      }
+      int k = 63 - __builtin_clzll(end - begin);
+      const vector<float>& level = levels[k];
+      return range_combine(kind, level[begin], level[end - (uint64_t(1) << k)]);
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !csr->empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      assert(kind == RANGE_MAX);
+      return query(series, fromDay, toDay) > threshold;
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      assert(kind == RANGE_MIN);
+      return query(series, fromDay, toDay) < threshold;
+    }
+
+  private:
+
+    const SeriesCsr* csr = nullptr;
+    RangeKind kind;
+    vector<vector<float> > levels;
+};
+
+// -------------------------------------------------
+// Per-series segment trees for range max or range
+// min that, unlike RangeExtremeIndex, take updates.
+// The leaves are the values of a series in day
+// order, and a day after the last one is an
+// amortized O(log n) append into spare leaves.
+// -------------------------------------------------
+class SeriesSegmentTree : public SeriesIndex {
+  public:
+
+    explicit SeriesSegmentTree(const RangeKind kind_) : kind(kind_) {}
+
+    virtual void build(SeriesCsr& csr) override {
+      trees.assign(csr.numSeries(), Tree());
+      for (uint32_t s = 0; s < csr.numSeries(); s++) {
+        Tree& t = trees[s];
+        t.days.assign(csr.days().data + csr.begin(s), csr.days().data + csr.end(s));
+        t.values.assign(csr.values().data + csr.begin(s), csr.values().data + csr.end(s));
+        rebuild(t);
+      }
+    }
+
+    size_t numSeries() const { return trees.size(); }
+
+    bool empty(const uint32_t series) const {
+      return series >= trees.size() || trees[series].days.empty();
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      assert(kind == RANGE_MAX);
+      return query(series, fromDay, toDay) > threshold;
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      assert(kind == RANGE_MIN);
+      return query(series, fromDay, toDay) < threshold;
+    }
+
+    // Sets the value of the series on day, adding the day if it is new.
+    // New series may be added too. Days after the last one of a series and
+    // days that already exist take O(log n); an earlier new day rebuilds
+    // that series.
+    void set(const uint32_t series, const int32_t day, const float value) {
+      if (series >= trees.size()) {
+        trees.resize(series + 1);
+      }
+      Tree& t = trees[series];
+      auto pos = std::lower_bound(t.days.begin(), t.days.end(), day);
+      size_t i = pos - t.days.begin();
+      if (pos != t.days.end() && *pos == day) {
+        t.values[i] = value;
+        update(t, i);
+      } else if (pos == t.days.end() && t.days.size() < t.capacity) {
+        t.days.push_back(day);
+        t.values.push_back(value);
+        update(t, i);
+      } else {
+        t.days.insert(pos, day);
+        t.values.insert(t.values.begin() + i, value);
+        rebuild(t);
+      }
+    }
+
+    // Largest (RANGE_MAX) or smallest (RANGE_MIN) value of the series on
+    // the days [fromDay, toDay]; -inf or +inf if there is none. NaN values
+    // are ignored.
+    float query(const uint32_t series, const int32_t fromDay, const int32_t toDay) const {
+      if (empty(series)) {
+        return range_none(kind);
+      }
+      const Tree& t = trees[series];
+      size_t lo = std::lower_bound(t.days.begin(), t.days.end(), fromDay) - t.days.begin();
+      size_t hi = std::upper_bound(t.days.begin(), t.days.end(), toDay) - t.days.begin();
+      float result = range_none(kind);
+      for (lo += t.capacity, hi += t.capacity; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) {
+          result = range_combine(kind, result, t.nodes[lo++]);
+        }
+        if (hi & 1) {
+          result = range_combine(kind, result, t.nodes[--hi]);
+        }
+      }
+      return result;
+    }
+
+  private:
+
+    // Leaf i of a series with the given capacity is nodes[capacity + i],
+    // and node n combines nodes 2n and 2n + 1
+    struct Tree {
+      vector<int32_t> days;
+      vector<float> values;
+      vector<float> nodes;
+      size_t capacity = 0;
+    };
+
+    RangeKind kind;
+    vector<Tree> trees;
+
+    void update(Tree& t, size_t i) {
+      size_t n = t.capacity + i;
+      t.nodes[n] = range_leaf(kind, t.values[i]);
+      for (n /= 2; n > 0; n /= 2) {
+        t.nodes[n] = range_combine(kind, t.nodes[2 * n], t.nodes[2 * n + 1]);
+      }
+    }
+
+    // Sizes the tree to the next power of two above the series length,
+    // leaving room for appends, and recomputes every node
+    void rebuild(Tree& t) {
+      t.capacity = 1;
+      while (t.capacity <= t.days.size()) {
+        t.capacity *= 2;
+      }
+      t.nodes.assign(2 * t.capacity, range_none(kind));
+      for (size_t i = 0; i < t.values.size(); i++) {
+        t.nodes[t.capacity + i] = range_leaf(kind, t.values[i]);
+      }
+      for (size_t n = t.capacity - 1; n > 0; n--) {
+        t.nodes[n] = range_combine(kind, t.nodes[2 * n], t.nodes[2 * n + 1]);
+      }
+    }
+};
+
+// -------------------------------------------------
+// Zone maps over a SeriesCsr: the min and max of
+// every block of BLOCK_ROWS consecutive rows of a
+// series, with the first and last day of the block.
+// Blocks count rows, not calendar days, so gaps in a
+// series leave no empty or short blocks. A threshold
+// predicate settles a block that lies inside the day
+// window from its summary alone.
+// Values are read only for the blocks at the ends of
+// the window that may hold a match.
+// -------------------------------------------------
+class ZoneMap : public SeriesIndex {
+  public:
+
+    static const uint64_t BLOCK_ROWS = 64;
+
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      zoneOffsets.assign(1, 0);
+      zones.clear();
+      const int32_t* days = csr->days().data;
+      const float* values = csr->values().data;
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        for (uint64_t b = csr->begin(s); b < csr->end(s); b += BLOCK_ROWS) {
+          uint64_t e = min(b + BLOCK_ROWS, csr->end(s));
+          Zone zone;
+          zone.firstDay = days[b];
+          zone.lastDay = days[e - 1];
+          zone.min = std::numeric_limits<float>::infinity();
+          zone.max = -std::numeric_limits<float>::infinity();
+          for (uint64_t i = b; i < e; i++) {
+            // NaN values fail both comparisons and are left out
+            zone.min = values[i] < zone.min ? values[i] : zone.min;
+            zone.max = values[i] > zone.max ? values[i] : zone.max;
+          }
+          zones.push_back(zone);
+        }
+        zoneOffsets.push_back(zones.size());
+      }
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !csr->empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any<true>(series, fromDay, toDay, threshold, ScanStraddle<true>(*csr, fromDay, toDay, threshold));
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any<false>(series, fromDay, toDay, threshold, ScanStraddle<false>(*csr, fromDay, toDay, threshold));
+    }
+
+    // Number of blocks of all series. Blocks are numbered in the
+    // order of the SeriesCsr.
+    size_t numBlocks() const { return zones.size(); }
+
+    // Settles the blocks inside the window from their summaries, and
+    // asks straddle(block, begin, end) about the blocks that straddle an
+    // end of it and could hold a match. block is the number of the block
+    // and [begin, end) its rows in the SeriesCsr. The values of the CSR
+    // are only read through straddle, so they may be stored elsewhere.
+    template <bool Above, typename Straddle>
+    bool any(const uint32_t series, const int32_t fromDay, const int32_t toDay, const double threshold,
+        Straddle straddle) const {
+      const Zone* first = zones.data() + zoneOffsets[series];
+      const Zone* last = zones.data() + zoneOffsets[series + 1];
+      const Zone* zone = std::lower_bound(first, last, fromDay,
+          [](const Zone& z, const int32_t day) { return z.lastDay < day; });
+      for (; zone != last && zone->firstDay <= toDay; zone++) {
+        if (Above ? !(zone->max > threshold) : !(zone->min < threshold)) {
+          continue;
+        }
+        if (zone->firstDay >= fromDay && zone->lastDay <= toDay) {
+          return true;
+        }
+        uint64_t b = csr->begin(series) + (zone - first) * BLOCK_ROWS;
+        uint64_t e = min(b + BLOCK_ROWS, csr->end(series));
+        if (straddle(zone - zones.data(), b, e)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+  private:
+
+    struct Zone {
+      int32_t firstDay;
+      int32_t lastDay;
+      float min;
+      float max;
+    };
+
+    // Checks the rows of a straddling block against the CSR values
+    template <bool Above>
+    struct ScanStraddle {
+      const SeriesCsr& csr;
+      int32_t fromDay, toDay;
+      double threshold;
+
+      ScanStraddle(const SeriesCsr& csr_, const int32_t fromDay_, const int32_t toDay_, const double threshold_) :
+        csr(csr_), fromDay(fromDay_), toDay(toDay_), threshold(threshold_) {}
+
+      bool operator()(const uint64_t, const uint64_t begin, const uint64_t end) const {
+        const int32_t* days = csr.days().data;
+        const float* values = csr.values().data;
+        for (uint64_t i = begin; i < end; i++) {
+          if (days[i] >= fromDay && days[i] <= toDay && (Above ? values[i] > threshold : values[i] < threshold)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    };
+
+    const SeriesCsr* csr = nullptr;
+    vector<uint64_t> zoneOffsets;
+    vector<Zone> zones;
+};
+
+// -------------------------------------------------
+// Wavelet matrix over the values of a SeriesCsr.
+// Values are replaced by their rank among the
+// distinct values, and every level splits the ranks
+// on one bit, so counting the values of a day window
+// in a value range, or finding the k-th smallest
+// one, takes one rank per level: O(log distinct
+// values), with no scan. Each window lies inside one
+// series, so one matrix serves all of them. NaN gets
+// the rank after every real value and is never counted.
+// -------------------------------------------------
+class SeriesWaveletIndex : public SeriesIndex {
+  public:
+
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      const ArrayRef<float>& values = csr->values();
+      size_t n = values.size;
+
+      distinct.clear();
+      for (auto v : values) {
+        if (v == v) {
+          distinct.push_back(v);
+        }
+      }
+      std::sort(distinct.begin(), distinct.end());
+      distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+      uint32_t nanRank = distinct.size();
+
+      vector<uint32_t> ranks(n);
+      for (size_t i = 0; i < n; i++) {
+        ranks[i] = values[i] == values[i] ?
+          std::lower_bound(distinct.begin(), distinct.end(), values[i]) - distinct.begin() : nanRank;
+      }
+
+      numLevels = 1;
+      while ((uint64_t(1) << numLevels) <= nanRank) {
+        numLevels++;
+      }
+      levels.assign(numLevels, Level());
+      vector<uint32_t> zeros, ones;
+      for (int l = 0; l < numLevels; l++) {
+        Level& level = levels[l];
+        int shift = numLevels - 1 - l;
+        level.words.assign(n / 64 + 1, 0);
+        level.ranks.assign(n / 64 + 1, 0);
+        zeros.clear();
+        ones.clear();
+        for (size_t i = 0; i < n; i++) {
+          if ((ranks[i] >> shift) & 1) {
+            level.words[i / 64] |= uint64_t(1) << (i % 64);
+            ones.push_back(ranks[i]);
+          } else {
+            zeros.push_back(ranks[i]);
+          }
+        }
+        for (size_t w = 1; w < level.words.size(); w++) {
+          level.ranks[w] = level.ranks[w - 1] + __builtin_popcountll(level.words[w - 1]);
+        }
+        level.numZeros = zeros.size();
+        // Stable partition by this bit: the order the next level sees
+        std::copy(zeros.begin(), zeros.end(), ranks.begin());
+        std::copy(ones.begin(), ones.end(), ranks.begin() + zeros.size());
+      }
+    }
+
+    // Number of values, NaN excluded, on the days [fromDay, toDay]
+    uint64_t count(const uint32_t series, const int32_t fromDay, const int32_t toDay) const {
+      uint64_t begin, end;
+      window(series, fromDay, toDay, begin, end);
+      return countLess(begin, end, distinct.size());
+    }
+
+    // Number of values on the days [fromDay, toDay] above / below threshold
+    uint64_t countAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay, const double threshold) const {
+      uint64_t begin, end;
+      window(series, fromDay, toDay, begin, end);
+      uint32_t firstAbove = std::upper_bound(distinct.begin(), distinct.end(), threshold,
+          [](const double t, const float v) { return t < v; }) - distinct.begin();
+      return countLess(begin, end, distinct.size()) - countLess(begin, end, firstAbove);
+    }
+
+    uint64_t countBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay, const double threshold) const {
+      uint64_t begin, end;
+      window(series, fromDay, toDay, begin, end);
+      uint32_t firstNotBelow = std::lower_bound(distinct.begin(), distinct.end(), threshold,
+          [](const float v, const double t) { return v < t; }) - distinct.begin();
+      return countLess(begin, end, firstNotBelow);
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !csr->empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return countAbove(series, fromDay, toDay, threshold) > 0;
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return countBelow(series, fromDay, toDay, threshold) > 0;
+    }
+
+    // The k-th smallest value (from 0) on the days [fromDay, toDay],
+    // NaN excluded; k must be below count()
+    float kth(const uint32_t series, const int32_t fromDay, const int32_t toDay, uint64_t k) const {
+      uint64_t begin, end;
+      window(series, fromDay, toDay, begin, end);
+      assert(k < countLess(begin, end, distinct.size()));
+      uint32_t rank = 0;
+      for (int l = 0; l < numLevels; l++) {
+        const Level& level = levels[l];
+        uint64_t zerosBegin = begin - level.rank1(begin), zerosEnd = end - level.rank1(end);
+        if (k < zerosEnd - zerosBegin) {
+          begin = zerosBegin;
+          end = zerosEnd;
+        } else {
+          k -= zerosEnd - zerosBegin;
+          rank |= uint32_t(1) << (numLevels - 1 - l);
+          begin = level.numZeros + level.rank1(begin);
+          end = level.numZeros + level.rank1(end);
+        }
+      }
+      return distinct[rank];
+    }
+
+  private:
+
+    // A bit per value, with the number of set bits before every word
+    struct Level {
+      vector<uint64_t> words;
+      vector<uint64_t> ranks;
+      uint64_t numZeros = 0;
+
+      uint64_t rank1(const uint64_t i) const {
+        return ranks[i / 64] + __builtin_popcountll(words[i / 64] & ((uint64_t(1) << (i % 64)) - 1));
+      }
+    };
+
+    const SeriesCsr* csr = nullptr;
+    vector<float> distinct;
+    int numLevels = 0;
+    vector<Level> levels;
+
+    void window(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        uint64_t& begin, uint64_t& end) const {
+      begin = csr->lowerBound(series, fromDay);
+      end = max(begin, csr->upperBound(series, toDay));
+    }
+
+    // Number of values in positions [begin, end) whose rank is below limit
+    uint64_t countLess(uint64_t begin, uint64_t end, const uint32_t limit) const {
+      if (limit >= (uint64_t(1) << numLevels)) {
+        return end - begin;
+      }
+      uint64_t result = 0;
+      for (int l = 0; l < numLevels && begin < end; l++) {
+        const Level& level = levels[l];
+        uint64_t zerosBegin = begin - level.rank1(begin), zerosEnd = end - level.rank1(end);
+        if ((limit >> (numLevels - 1 - l)) & 1) {
+          result += zerosEnd - zerosBegin;
+          begin = level.numZeros + level.rank1(begin);
+          end = level.numZeros + level.rank1(end);
+        } else {
+          begin = zerosBegin;
+          end = zerosEnd;
+        }
+      }
+      return result;
+    }
+};
+
+// -------------------------------------------------
+// Lossless compression of the values of a SeriesCsr
+// in the style of Gorilla: each value is XORed with
+// the previous one, and only the meaningful bits of
+// the XOR are stored, reusing the previous leading
+// and trailing zero counts when they still fit. A
+// series is cut into the blocks of a ZoneMap, each
+// encoded on its own, so a threshold predicate is
+// settled by the zone map and only decodes the
+// blocks that straddle the window and could change
+// its answer, stopping at the first match. Days
+// stay in the SeriesCsr, and its values are freed.
+// -------------------------------------------------
+class GorillaSeries : public SeriesIndex {
+  public:
+
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      zones.build(csr_);
+      blockBits.clear();
+      bits.clear();
+      numBits = 0;
+      const float* values = csr->values().data;
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        for (uint64_t b = csr->begin(s); b < csr->end(s); b += ZoneMap::BLOCK_ROWS) {
+          uint64_t e = min(b + ZoneMap::BLOCK_ROWS, csr->end(s));
+          blockBits.push_back(numBits);
+          encode(values + b, e - b);
+        }
+      }
+      assert(blockBits.size() == zones.numBlocks());
+      // Lets the decoder always read the word after the current one
+      bits.push_back(0);
+      csr_.releaseValues();
+    }
+
+    // Decodes every value, in the order of the SeriesCsr
+    void decodeAll(vector<float>& out) const {
+      out.clear();
+      uint64_t block = 0;
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        for (uint64_t b = csr->begin(s); b < csr->end(s); b += ZoneMap::BLOCK_ROWS, block++) {
+          uint64_t e = min(b + ZoneMap::BLOCK_ROWS, csr->end(s));
+          Decoder decoder(bits.data(), blockBits[block]);
+          for (uint64_t i = b; i < e; i++) {
+            out.push_back(decoder.next());
+          }
+        }
+      }
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !csr->empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return zones.any<true>(series, fromDay, toDay, threshold, DecodeStraddle<true>(*this, fromDay, toDay, threshold));
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return zones.any<false>(series, fromDay, toDay, threshold, DecodeStraddle<false>(*this, fromDay, toDay, threshold));
+    }
+
+    virtual void save(SnapshotWriter& snapshot, const SeriesCsr& csr_, const SeriesSectionTags& tags) const override {
+      vector<float> values;
+      decodeAll(values);
+      snapshot.add(tags.offsets, csr_.offsets());
+      snapshot.add(tags.days, csr_.days());
+      snapshot.add(tags.values, std::move(values));
+    }
+
+  private:
+
+    // Reads the values of one block back
+    class Decoder {
+      public:
+
+        Decoder(const uint64_t* bits_, const uint64_t pos_) :
+          bits(bits_), pos(pos_), prev(0), leading(0), trailing(0), first(true) {}
+
+        float next() {
+          if (first) {
+            first = false;
+            prev = read(32);
+          } else if (read(1) == 1) {
+            if (read(1) == 1) {
+              leading = read(5);
+              int meaningful = read(5) + 1;
+              trailing = 32 - leading - meaningful;
             }
+            prev ^= read(32 - leading - trailing) << trailing;
+          }
+          float value;
+          memcpy(&value, &prev, sizeof(value));
+          return value;
+        }
+
+      private:
+
+        const uint64_t* bits;
+        uint64_t pos;
+        uint32_t prev;
+        int leading;
+        int trailing;
+        bool first;
+
+        uint32_t read(const int n) {
+          uint64_t word = pos / 64, shift = pos % 64;
+          uint64_t v = bits[word] >> shift;
+          if (shift + n > 64) {
+            v |= bits[word + 1] << (64 - shift);
+          }
+          pos += n;
+          return v & ((uint64_t(1) << n) - 1);
+        }
+    };
+
+    // Decodes a straddling block up to the end of the window
+    template <bool Above>
+    struct DecodeStraddle {
+      const GorillaSeries& series;
+      int32_t fromDay, toDay;
+      double threshold;
+
+      DecodeStraddle(const GorillaSeries& series_, const int32_t fromDay_, const int32_t toDay_,
+          const double threshold_) :
+        series(series_), fromDay(fromDay_), toDay(toDay_), threshold(threshold_) {}
+
+      bool operator()(const uint64_t block, const uint64_t begin, const uint64_t end) const {
+        const int32_t* days = series.csr->days().data;
+        Decoder decoder(series.bits.data(), series.blockBits[block]);
+        for (uint64_t i = begin; i < end && days[i] <= toDay; i++) {
+          float value = decoder.next();
+          if (days[i] >= fromDay && (Above ? value > threshold : value < threshold)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    };
+
+    const SeriesCsr* csr = nullptr;
+    // Min and max of every block, and where its bits start
+    ZoneMap zones;
+    vector<uint64_t> blockBits;
+    vector<uint64_t> bits;
+    uint64_t numBits = 0;
+
+    void write(const uint64_t v, const int n) {
+      uint64_t word = numBits / 64, shift = numBits % 64;
+      while (bits.size() < (numBits + n + 63) / 64) {
+        bits.push_back(0);
+      }
+      bits[word] |= v << shift;
+      if (shift + n > 64) {
+        bits[word + 1] |= v >> (64 - shift);
+      }
+      numBits += n;
+    }
+
+    void encode(const float* values, const uint64_t count) {
+      uint32_t prev;
+      memcpy(&prev, values, sizeof(prev));
+      write(prev, 32);
+      int leading = -1, trailing = 0;
+      for (uint64_t i = 1; i < count; i++) {
+        uint32_t cur;
+        memcpy(&cur, values + i, sizeof(cur));
+        uint32_t x = cur ^ prev;
+        prev = cur;
+        if (x == 0) {
+          write(0, 1);
+          continue;
+        }
+        write(1, 1);
+        int lz = __builtin_clz(x), tz = __builtin_ctz(x);
+        if (leading >= 0 && lz >= leading && tz >= trailing) {
+          write(0, 1);
+        } else {
+          leading = lz;
+          trailing = tz;
+          write(1, 1);
+          write(leading, 5);
+          write(32 - leading - trailing - 1, 5);
+        }
+        write(x >> trailing, 32 - leading - trailing);
+      }
+    }
+};
+
+// -------------------------------------------------
+// Day arrays of a SeriesCsr, delta encoded and bit
+// packed in blocks of BLOCK_ROWS days. A block
+// stores the gaps between its days at the width of
+// the largest gap, with its first day as the frame
+// of reference. The gaps are laid out in 4 lanes of
+// 32-bit words, with lane j holding gaps j, j + 4,
+// ..., so four gaps unpack with the same shifts and
+// SSE2 does them together. The first and last day of
+// every block form a skip index, so finding a day
+// unpacks a single block. The days of the SeriesCsr
+// are freed, and its values are scanned between the
+// two bounds of a window.
+// -------------------------------------------------
+class PackedDays : public SeriesIndex {
+  public:
+
+    static const uint64_t BLOCK_ROWS = 64;
+
+    virtual void build(SeriesCsr& csr_) override {
+      csr = &csr_;
+      blockOffsets.assign(1, 0);
+      blocks.clear();
+      words.clear();
+      const int32_t* days = csr->days().data;
+      uint32_t gaps[BLOCK_ROWS];
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        for (uint64_t b = csr->begin(s); b < csr->end(s); b += BLOCK_ROWS) {
+          uint64_t e = min(b + BLOCK_ROWS, csr->end(s));
+          Block block;
+          block.firstDay = days[b];
+          block.lastDay = days[e - 1];
+          block.wordOffset = words.size();
+          uint32_t widest = 0;
+          for (uint64_t i = 0; i < BLOCK_ROWS; i++) {
+            gaps[i] = i == 0 || b + i >= e ? 0 : (uint32_t) days[b + i] - (uint32_t) days[b + i - 1];
+            widest |= gaps[i];
           }
+          block.width = widest == 0 ? 0 : 32 - __builtin_clz(widest);
+          pack(gaps, block.width);
+          blocks.push_back(block);
         }
-        if (valid_flag == true) {
-          if (ite->second == "stock") valid_stock_cnt += trades_ite->second.size();
-          else valid_bond_cnt += trades_ite->second.size();
+        blockOffsets.push_back(blocks.size());
+      }
+      // Lets unpack() always read the words after a block
+      words.resize(words.size() + LANES, 0);
+      csr_.releaseDays();
+    }
+
+    // Position in the SeriesCsr of the first day of the series that is
+    // not before / after day
+    uint64_t lowerBound(const uint32_t series, const int32_t day) const {
+      return bound<false>(series, day);
+    }
+
+    uint64_t upperBound(const uint32_t series, const int32_t day) const {
+      return bound<true>(series, day);
+    }
+
+    virtual bool hasAny(const uint32_t series) const override {
+      return !csr->empty(series);
+    }
+
+    virtual bool anyAbove(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any<true>(series, fromDay, toDay, threshold);
+    }
+
+    virtual bool anyBelow(const uint32_t series, const int32_t fromDay, const int32_t toDay,
+        const double threshold) const override {
+      return any<false>(series, fromDay, toDay, threshold);
+    }
+
+    virtual void save(SnapshotWriter& snapshot, const SeriesCsr& csr_, const SeriesSectionTags& tags) const override {
+      vector<int32_t> days;
+      decodeAll(days);
+      snapshot.add(tags.offsets, csr_.offsets());
+      snapshot.add(tags.days, std::move(days));
+      snapshot.add(tags.values, csr_.values());
+    }
+
+    // Decodes every day, in the order of the SeriesCsr
+    void decodeAll(vector<int32_t>& out) const {
+      out.clear();
+      int32_t days[BLOCK_ROWS];
+      for (uint32_t s = 0; s < csr->numSeries(); s++) {
+        for (uint64_t z = blockOffsets[s]; z < blockOffsets[s + 1]; z++) {
+          unpack(blocks[z], days);
+          uint64_t count = csr->end(s) - csr->begin(s) - (z - blockOffsets[s]) * BLOCK_ROWS;
+          out.insert(out.end(), days, days + (count < BLOCK_ROWS ? count : BLOCK_ROWS));
+        }
+      }
+    }
+
+  private:
+
+    static const uint32_t LANES = 4;
+
+    struct Block {
+      int32_t firstDay;
+      int32_t lastDay;
+      uint32_t wordOffset;
+      uint32_t width;
+    };
+
+    const SeriesCsr* csr = nullptr;
+    vector<uint64_t> blockOffsets;
+    vector<Block> blocks;
+    vector<uint32_t> words;
+
+    // Gap i goes to lane i % 4 at bit (i / 4) * width of that lane
+    void pack(const uint32_t* gaps, const uint32_t width) {
+      size_t base = words.size();
+      words.resize(base + LANES * ((BLOCK_ROWS / LANES * width + 31) / 32), 0);
+      for (uint64_t i = 0; width > 0 && i < BLOCK_ROWS; i++) {
+        uint64_t bit = (i / LANES) * width;
+        uint64_t lane = i % LANES, word = bit / 32, shift = bit % 32;
+        words[base + word * LANES + lane] |= gaps[i] << shift;
+        if (shift + width > 32) {
+          words[base + (word + 1) * LANES + lane] |= gaps[i] >> (32 - shift);
+        }
+      }
+    }
+
+    // Writes the BLOCK_ROWS days of a block; days past the end of the
+    // series repeat the last day
+    void unpack(const Block& block, int32_t* days) const {
+      const uint32_t* in = words.data() + block.wordOffset;
+      const uint32_t width = block.width;
+      uint32_t gaps[BLOCK_ROWS];
+#if defined(__SSE2__)
+      const __m128i mask = _mm_set1_epi32(width == 32 ? -1 : (int) ((uint32_t(1) << width) - 1));
+      for (uint64_t r = 0; r < BLOCK_ROWS / LANES; r++) {
+        uint64_t bit = r * width, word = bit / 32, shift = bit % 32;
+        __m128i v = _mm_srl_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + word * LANES)),
+            _mm_cvtsi32_si128(shift));
+        if (shift + width > 32) {
+          __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + (word + 1) * LANES));
+          v = _mm_or_si128(v, _mm_sll_epi32(next, _mm_cvtsi32_si128(32 - shift)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(gaps + r * LANES), _mm_and_si128(v, mask));
+      }
+#else
+      const uint32_t mask = width == 32 ? ~uint32_t(0) : (uint32_t(1) << width) - 1;
+      for (uint64_t i = 0; i < BLOCK_ROWS; i++) {
+        uint64_t bit = (i / LANES) * width;
+        uint64_t lane = i % LANES, word = bit / 32, shift = bit % 32;
+        uint32_t v = in[word * LANES + lane] >> shift;
+        if (shift + width > 32) {
+          v |= in[(word + 1) * LANES + lane] << (32 - shift);
+        }
+        gaps[i] = width == 0 ? 0 : v & mask;
+      }
+#endif
+      uint32_t day = block.firstDay;
+      for (uint64_t i = 0; i < BLOCK_ROWS; i++) {
+        day += gaps[i];
+        days[i] = (int32_t) day;
+      }
+    }
+
+    template <bool Above>
+    bool any(const uint32_t series, const int32_t fromDay, const int32_t toDay, const double threshold) const {
+      const float* values = csr->values().data;
+      for (uint64_t i = lowerBound(series, fromDay), end = upperBound(series, toDay); i < end; i++) {
+        if (Above ? values[i] > threshold : values[i] < threshold) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    template <bool After>
+    uint64_t bound(const uint32_t series, const int32_t day) const {
+      const Block* first = blocks.data() + blockOffsets[series];
+      const Block* last = blocks.data() + blockOffsets[series + 1];
+      const Block* block = std::lower_bound(first, last, day,
+          [](const Block& z, const int32_t d) { return After ? z.lastDay <= d : z.lastDay < d; });
+      if (block == last) {
+        return csr->end(series);
+      }
+      int32_t days[BLOCK_ROWS];
+      unpack(*block, days);
+      uint64_t i = After ? std::upper_bound(days, days + BLOCK_ROWS, day) - days :
+        std::lower_bound(days, days + BLOCK_ROWS, day) - days;
+      return csr->begin(series) + (block - first) * BLOCK_ROWS + i;
+    }
+};
+
+// Index that exe() answers its range predicates with
+enum SeriesIndexKind {
+  SERIES_INDEX_HYBRID,
+  SERIES_INDEX_RMQ,
+  SERIES_INDEX_SEGMENT_TREE,
+  SERIES_INDEX_ZONE_MAP,
+  SERIES_INDEX_WAVELET,
+  SERIES_INDEX_GORILLA,
+  SERIES_INDEX_PACKED_DAYS
+};
+
+// New index of the given kind. Range indexes keep the given extreme;
+// the others answer both predicates.
+static inline
+SeriesIndex* new_series_index(const SeriesIndexKind kind, const RangeKind extreme) {
+  switch (kind)
+  {
+  case SERIES_INDEX_RMQ:
+    return new RangeExtremeIndex(extreme);
+  case SERIES_INDEX_SEGMENT_TREE:
+    return new SeriesSegmentTree(extreme);
+  case SERIES_INDEX_ZONE_MAP:
+    return new ZoneMap();
+  case SERIES_INDEX_WAVELET:
+    return new SeriesWaveletIndex();
+  case SERIES_INDEX_GORILLA:
+    return new GorillaSeries();
+  case SERIES_INDEX_PACKED_DAYS:
+    return new PackedDays();
+  default:
+    return new HybridSeries();
+  }
+}
+
+// -------------------------------------------------
+// Specific query engine implementation that
+// keeps full tables as ColumnarTables
+// -------------------------------------------------
+class ReferenceQueryEngine : public QueryEngine {
+  public:
+
+    // Holds the bytes of the interned asset and class names, and
+    // nothing else. The dictionaries' hash tables and the per-asset
+    // arrays are ordinary heap allocations.
+    Arena arena;
+
+    vector<ColumnarTable> tables;
+
+    // ---------------------------------------------------------------------------------
+    // Some notes on my tables:
+    // I believe the most efficient way is to perform the query with parsing and reture 
+    // stored results when exe(). But that sounds not the purpose of this assignment.
+    // Here's some bottomlines which I think is reasonable for the query engine. 
+    // 1. Datastructures contain the same amount of information with DenseTable, i.e. can 
+    // tranform from one to the other and vice versa. 
+    // 2. Only save data while the tables load (beginTable/appendRows/finishLoad) and do not
+    // perform any query-related computation.
+    // ---------------------------------------------------------------------------------
+    // Projection pushdown relaxes 1.: only the columns in queryColumns() are loaded,
+    // so trades are kept as counts per asset and day. With retain_tables set, every column is
+    // loaded and `tables` keeps a full copy of every row, which restores 1.
+    // Asset names are interned once into asset_ids, and all per-asset data lives in
+    // arrays indexed by asset id. An empty series or a zero count means the asset has
+    // no rows in that table. The price and volume series are CSR arrays built once
+    // the load finishes, or the arrays of a mapped snapshot. exe() reads them through
+    // price_index and volume_index, of the kind chosen by series_index: by default
+    // hybrid indexes that move dense series to day-indexed arrays, range max/min
+    // sparse tables, segment trees, zone maps, or wavelet matrices, which also count
+    // values over a threshold in a window. With Gorilla compressed series, the raw
+    // values are freed after the load, and with packed days, the raw days.
+    // Indexes are built from the CSR after a CSV load. A snapshot also holds the
+    // dictionary hash tables, the trade counts and the hybrid indexes, which are
+    // used in place from the mapping; other indexes are built after the snapshot
+    // loads. Only the segment trees take live updates, and those updates are not
+    // written back to the CSR or to snapshots.
+    // ---------------------------------------------------------------------------------
+    vector<tuple<std::string, vector<std::string>, vector<FieldType>>> table_headers;
+    StringDictionary asset_ids;
+    // Asset classes are interned into class_ids too. Tradable assets are kept in
+    // order of appearance, and partitioned by class in class_to_ids.
+    StringDictionary class_ids;
+    vector<uint32_t> tradable_ids;
+    // Class id of every asset, SNAPSHOT_NO_CLASS if it is not tradable
+    vector<uint32_t> id_to_class;
+    vector<vector<uint32_t> > class_to_ids;
+    SeriesCsr price_series, volume_series;
+    // Price indexes keep maxima and volume indexes minima
+    unique_ptr<SeriesIndex> price_index, volume_index;
+    TradeAggregate trade_counts;
+    // Keeps a loaded snapshot mapped while the series point into it
+    unique_ptr<MappedFile> snapshot_file;
+
+    bool retain_tables = false;
+
+    // Must be set before the load
+    SeriesIndexKind series_index = SERIES_INDEX_HYBRID;
+
+    int cur_table_flag = -1;
+    // Positions of the queryColumns() of the current table, in the order
+    // they are listed there
+    vector<int> cur_columns;
+
+    ReferenceQueryEngine() : arena(1 << 20), asset_ids(arena), class_ids(arena) {}
+
+    // The (table, column, type) triples that the load keeps. exe() reads
+    // the tradable and series columns, and trades.day only goes into the
+    // per-day counts of trade_counts, which the asset report reads.
+    static const vector<tuple<std::string, std::string, FieldType> >& queryColumns() {
+      static const vector<tuple<std::string, std::string, FieldType> > columns = {
+        make_tuple("tradable", "asset-name", FIELD_TYPE_STRING),
+        make_tuple("tradable", "asset-class", FIELD_TYPE_STRING),
+        make_tuple("price-over-time", "day", FIELD_TYPE_INT),
+        make_tuple("price-over-time", "asset-name", FIELD_TYPE_STRING),
+        make_tuple("price-over-time", "price", FIELD_TYPE_FLOAT),
+        make_tuple("volume-over-time", "day", FIELD_TYPE_INT),
+        make_tuple("volume-over-time", "asset-name", FIELD_TYPE_STRING),
+        make_tuple("volume-over-time", "volume", FIELD_TYPE_FLOAT),
+        make_tuple("trades", "day", FIELD_TYPE_INT),
+        make_tuple("trades", "asset-name", FIELD_TYPE_STRING)
+      };
+      return columns;
+    }
+
+    // Looks the queryColumns() of schema's table up by name and returns
+    // their positions, in the order they are listed there. Empty if the
+    // table is not queried, or if a column is missing or has another type.
+    static vector<int> queryColumnPositions(const TableSchema& schema) {
+      vector<int> positions;
+      if (!findQueryColumns(schema, positions)) {
+        cout << "Error: Table " << schema.name << " lacks a queried column or has it with another type" << endl;
+        assert(false);
+      }
+      return positions;
+    }
+
+    // Like queryColumnPositions, but returns false instead of failing
+    // when a queried column is missing or has another type
+    static bool findQueryColumns(const TableSchema& schema, vector<int>& positions) {
+      positions.clear();
+      for (auto& tc : queryColumns()) {
+        if (get<0>(tc) != schema.name) {
+          continue;
+        }
+        auto it = std::find(schema.columnNames.begin(), schema.columnNames.end(), get<1>(tc));
+        if (it == schema.columnNames.end() || schema.columnTypes[it - schema.columnNames.begin()] != get<2>(tc)) {
+          positions.clear();
+          return false;
+        }
+        positions.push_back(it - schema.columnNames.begin());
+      }
+      return true;
+    }
+
+    virtual vector<bool> requiredColumns(const TableSchema& schema) const override {
+      vector<bool> required(schema.numColumns(), retain_tables);
+      for (int c : queryColumnPositions(schema)) {
+        required[c] = true;
+      }
+      return required;
+    }
+
+    virtual void beginTable(const TableSchema& schema) override {
+      tables.push_back(ColumnarTable(schema.name, schema.columnNames, schema.columnTypes));
+
+      const std::string& cur_table = schema.name;
+      table_headers.push_back(make_tuple(cur_table, schema.columnNames, schema.columnTypes));
+      if (cur_table == "tradable") {
+        cur_table_flag = TRADABLE;
+      } else if (cur_table == "price-over-time") {
+        cur_table_flag = PRICE_OVER_TIME;
+      } else if (cur_table == "volume-over-time") {
+        cur_table_flag = VOLUME_OVER_TIME;
+      } else if (cur_table == "trades") {
+        cur_table_flag = TRADES;
+      } else {
+        cur_table_flag = -1; // assert(false);
+      }
+      cur_columns = queryColumnPositions(schema);
+      if (cur_columns.empty()) {
+        cur_table_flag = -1;
+      }
+    }
+
+    virtual void appendRows(const ColumnBatch& batch) override {
+      assert(tables.size() > 0);
+
+      ColumnarTable& currentTable = tables.back();
+      int numCols = currentTable.numColumns();
+      assert(numCols == (int) batch.columns.size());
+
+      for (int c = 0; retain_tables && c < numCols; c++) {
+        const ColumnBuffer& col = batch.columns[c];
+        if (col.type == FIELD_TYPE_INT) {
+          currentTable.appendInts(c, col.ints);
+        } else if (col.type == FIELD_TYPE_FLOAT) {
+          currentTable.appendFloats(c, col.floats);
+        } else {
+          for (auto& cell : col.strings) {
+            currentTable.appendString(c, cell);
+          }
+        }
+      }
+
+      switch (cur_table_flag)
+      {
+      case TRADABLE: {
+        auto& names = batch.columns[cur_columns[0]].strings;
+        auto& classes = batch.columns[cur_columns[1]].strings;
+        for (size_t r = 0; r < batch.numRows; r++) {
+          addTradable(internAsset(names[r]), classes[r]);
+        }
+        break;
+      }
+      case PRICE_OVER_TIME: {
+        auto& days = batch.columns[cur_columns[0]].ints;
+        auto& names = batch.columns[cur_columns[1]].strings;
+        auto& prices = batch.columns[cur_columns[2]].floats;
+        for (size_t r = 0; r < batch.numRows; r++) {
+          price_series.stage(internAsset(names[r]), days[r], prices[r]);
+        }
+        break;
+      }
+      case VOLUME_OVER_TIME: {
+        auto& days = batch.columns[cur_columns[0]].ints;
+        auto& names = batch.columns[cur_columns[1]].strings;
+        auto& volumes = batch.columns[cur_columns[2]].floats;
+        for (size_t r = 0; r < batch.numRows; r++) {
+          volume_series.stage(internAsset(names[r]), days[r], volumes[r]);
+        }
+        break;
+      }
+      case TRADES: {
+        auto& days = batch.columns[cur_columns[0]].ints;
+        auto& names = batch.columns[cur_columns[1]].strings;
+        for (size_t r = 0; r < batch.numRows; r++) {
+          trade_counts.stage(internAsset(names[r]), days[r]);
+        }
+        break;
+      }
+      default:
+        break; // assert(false)
+      }
+    }
+
+    virtual void finishLoad() override {
+      price_series.build(asset_ids.size());
+      volume_series.build(asset_ids.size());
+      trade_counts.build(asset_ids.size());
+      buildIndexes();
+    }
+
+    // Writes everything exe() needs to a snapshot. The rows kept for
+    // retain_tables are not part of it.
+    bool saveSnapshot(const std::string& path, const uint64_t numLines) const {
+      std::ostringstream schemas;
+      for (auto& h : table_headers) {
+        schemas << "<TABLE>," << get<0>(h) << endl;
+        for (size_t c = 0; c < get<1>(h).size(); c++) {
+          schemas << (c > 0 ? "," : "") << get<1>(h)[c];
+        }
+        schemas << endl;
+        for (size_t c = 0; c < get<2>(h).size(); c++) {
+          schemas << (c > 0 ? "," : "") << get<2>(h)[c];
+        }
+        schemas << endl;
+      }
+      std::string schema_text = schemas.str();
+
+      vector<uint64_t> name_offsets(1, 0), class_offsets(1, 0);
+      std::string names, class_names;
+
+      for (uint32_t id = 0; id < asset_ids.size(); id++) {
+        names.append(asset_ids.name(id).data, asset_ids.name(id).size);
+        name_offsets.push_back(names.size());
+      }
+
+      for (uint32_t c = 0; c < class_ids.size(); c++) {
+        class_names.append(class_ids.name(c).data, class_ids.name(c).size);
+        class_offsets.push_back(class_names.size());
+      }
+
+      SnapshotWriter snapshot;
+      snapshot.add(SNAPSHOT_SCHEMAS, schema_text);
+      snapshot.add(SNAPSHOT_ASSET_NAME_OFFSETS, name_offsets);
+      snapshot.add(SNAPSHOT_ASSET_NAMES, names);
+      snapshot.add(SNAPSHOT_CLASS_NAME_OFFSETS, class_offsets);
+      snapshot.add(SNAPSHOT_CLASS_NAMES, class_names);
+      snapshot.add(SNAPSHOT_ASSET_CLASSES, id_to_class);
+      snapshot.add(SNAPSHOT_TRADABLE_IDS, tradable_ids);
+      price_index->save(snapshot, price_series, SNAPSHOT_PRICE_SECTIONS);
+      volume_index->save(snapshot, volume_series, SNAPSHOT_VOLUME_SECTIONS);
+      snapshot.add(SNAPSHOT_TRADE_DAY_OFFSETS, trade_counts.dayOffsets());
+      snapshot.add(SNAPSHOT_TRADE_DAYS, trade_counts.tradeDays());
+      snapshot.add(SNAPSHOT_TRADE_DAY_COUNTS, trade_counts.tradeDayCounts());
+      snapshot.add(SNAPSHOT_TRADE_RUNNING_COUNTS, trade_counts.runningCounts());
+      snapshot.add(SNAPSHOT_TRADE_DENSE_COUNTS, trade_counts.denseCounts());
+      snapshot.add(SNAPSHOT_TRADE_DENSE_RUNNING_COUNTS, trade_counts.denseRunningCounts());
+      snapshot.add(SNAPSHOT_ASSET_TABLE_CONTROL, asset_ids.table().controlBytes());
+      snapshot.add(SNAPSHOT_ASSET_TABLE_SLOTS, asset_ids.table().slots());
+      snapshot.add(SNAPSHOT_CLASS_TABLE_CONTROL, class_ids.table().controlBytes());
+      snapshot.add(SNAPSHOT_CLASS_TABLE_SLOTS, class_ids.table().slots());
+      return snapshot.write(path, numLines);
+    }
+
+    // Restores the state written by saveSnapshot() into an empty engine.
+    // Nothing is parsed or hashed: the dictionaries, series, trade counts
+    // and, if the snapshot has them, the hybrid indexes are used in place
+    // from the mapping. Only the small per-asset class arrays are copied,
+    // and indexes of other kinds are built.
+    bool loadSnapshot(const std::string& path, uint64_t& numLines) {
+      snapshot_file.reset(new MappedFile(path));
+      SnapshotReader snapshot(snapshot_file->data(), snapshot_file->size());
+
+      ArrayRef<char> schema_text, names, class_names;
+      ArrayRef<uint64_t> name_offsets, class_offsets, price_offsets, volume_offsets, trade_offsets;
+      ArrayRef<uint32_t> asset_classes, tradable, trade_day_counts;
+      ArrayRef<int32_t> price_days, volume_days, trade_days;
+      ArrayRef<float> prices, volumes;
+      ArrayRef<uint64_t> trade_running, trade_dense_running;
+      ArrayRef<TradeAggregate::Dense> trade_dense;
+      ArrayRef<int8_t> asset_control, class_control;
+      ArrayRef<FlatIdTable::Slot> asset_slots, class_slots;
+      if (!snapshot.valid() ||
+          !snapshot.section(SNAPSHOT_SCHEMAS, schema_text) ||
+          !snapshot.section(SNAPSHOT_ASSET_NAME_OFFSETS, name_offsets) ||
+          !snapshot.section(SNAPSHOT_ASSET_NAMES, names) ||
+          !snapshot.section(SNAPSHOT_CLASS_NAME_OFFSETS, class_offsets) ||
+          !snapshot.section(SNAPSHOT_CLASS_NAMES, class_names) ||
+          !snapshot.section(SNAPSHOT_ASSET_CLASSES, asset_classes) ||
+          !snapshot.section(SNAPSHOT_TRADABLE_IDS, tradable) ||
+          !snapshot.section(SNAPSHOT_PRICE_OFFSETS, price_offsets) ||
+          !snapshot.section(SNAPSHOT_PRICE_DAYS, price_days) ||
+          !snapshot.section(SNAPSHOT_PRICES, prices) ||
+          !snapshot.section(SNAPSHOT_VOLUME_OFFSETS, volume_offsets) ||
+          !snapshot.section(SNAPSHOT_VOLUME_DAYS, volume_days) ||
+          !snapshot.section(SNAPSHOT_VOLUMES, volumes) ||
+          !snapshot.section(SNAPSHOT_TRADE_DAY_OFFSETS, trade_offsets) ||
+          !snapshot.section(SNAPSHOT_TRADE_DAYS, trade_days) ||
+          !snapshot.section(SNAPSHOT_TRADE_DAY_COUNTS, trade_day_counts) ||
+          !snapshot.section(SNAPSHOT_TRADE_RUNNING_COUNTS, trade_running) ||
+          !snapshot.section(SNAPSHOT_TRADE_DENSE_COUNTS, trade_dense) ||
+          !snapshot.section(SNAPSHOT_TRADE_DENSE_RUNNING_COUNTS, trade_dense_running) ||
+          !snapshot.section(SNAPSHOT_ASSET_TABLE_CONTROL, asset_control) ||
+          !snapshot.section(SNAPSHOT_ASSET_TABLE_SLOTS, asset_slots) ||
+          !snapshot.section(SNAPSHOT_CLASS_TABLE_CONTROL, class_control) ||
+          !snapshot.section(SNAPSHOT_CLASS_TABLE_SLOTS, class_slots)) {
+        return false;
+      }
+
+      // Validate every schema before any table is begun
+      CsvLines header_lines;
+      tokenize_csv(schema_text.data, schema_text.size, header_lines);
+      if (header_lines.size() % 3 != 0) {
+        return false;
+      }
+      vector<TableSchema> schemas(header_lines.size() / 3);
+      vector<int> positions;
+      for (size_t i = 0; i < schemas.size(); i++) {
+        if (!TableSchema::parse(header_lines.at(3 * i), header_lines.at(3 * i + 1), header_lines.at(3 * i + 2), schemas[i]) ||
+            !findQueryColumns(schemas[i], positions)) {
+          return false;
+        }
+      }
+
+      if (!asset_ids.adopt(name_offsets, names, asset_control, asset_slots) ||
+          !class_ids.adopt(class_offsets, class_names, class_control, class_slots)) {
+        return false;
+      }
+      size_t num_assets = asset_ids.size();
+      size_t num_classes = class_ids.size();
+      if (!price_series.adopt(num_assets, price_offsets, price_days, prices) ||
+          !volume_series.adopt(num_assets, volume_offsets, volume_days, volumes) ||
+          !trade_counts.adopt(num_assets, trade_offsets, trade_days, trade_day_counts,
+            trade_running, trade_dense, trade_dense_running) ||
+          asset_classes.size != num_assets) {
+        return false;
+      }
+
+      // Every tradable asset once, with the class it was given
+      id_to_class.assign(num_assets, SNAPSHOT_NO_CLASS);
+      class_to_ids.assign(num_classes, vector<uint32_t>());
+      for (auto id : tradable) {
+        if (id >= num_assets || asset_classes[id] >= num_classes || id_to_class[id] != SNAPSHOT_NO_CLASS) {
+          return false;
+        }
+        id_to_class[id] = asset_classes[id];
+        class_to_ids[asset_classes[id]].push_back(id);
+      }
+      tradable_ids.assign(tradable.begin(), tradable.end());
+
+      for (auto& schema : schemas) {
+        beginTable(schema);
+      }
+
+      ArrayRef<HybridSeries::Format> price_formats, volume_formats;
+      ArrayRef<float> price_dense_values, volume_dense_values;
+      ArrayRef<uint64_t> price_presence, volume_presence;
+      bool hybrid = snapshot.has(SNAPSHOT_PRICE_FORMATS);
+      unique_ptr<HybridSeries> price_hybrid(new HybridSeries()), volume_hybrid(new HybridSeries());
+      if (hybrid &&
+          (!snapshot.section(SNAPSHOT_PRICE_FORMATS, price_formats) ||
+           !snapshot.section(SNAPSHOT_PRICE_DENSE_VALUES, price_dense_values) ||
+           !snapshot.section(SNAPSHOT_PRICE_PRESENCE, price_presence) ||
+           !snapshot.section(SNAPSHOT_VOLUME_FORMATS, volume_formats) ||
+           !snapshot.section(SNAPSHOT_VOLUME_DENSE_VALUES, volume_dense_values) ||
+           !snapshot.section(SNAPSHOT_VOLUME_PRESENCE, volume_presence) ||
+           !price_hybrid->adopt(price_series, price_formats, price_dense_values, price_presence) ||
+           !volume_hybrid->adopt(volume_series, volume_formats, volume_dense_values, volume_presence))) {
+        return false;
+      }
+      if (hybrid && series_index == SERIES_INDEX_HYBRID) {
+        price_index = std::move(price_hybrid);
+        volume_index = std::move(volume_hybrid);
+      } else {
+        if (hybrid) {
+          // The other indexes are built over CSRs that hold every series
+          vector<uint64_t> offsets;
+          vector<int32_t> days;
+          vector<float> values;
+          price_hybrid->decodeAll(offsets, days, values);
+          price_series.assign(offsets, days, values);
+          volume_hybrid->decodeAll(offsets, days, values);
+          volume_series.assign(offsets, days, values);
+        }
+        buildIndexes();
+      }
+      numLines = snapshot.numLines();
+      return true;
+    }
+
+    // Live updates of one day of an asset's series, for use after the load.
+    // They need series_index == SERIES_INDEX_SEGMENT_TREE. Assets that are
+    // in no table are skipped: they are not tradable, so they cannot
+    // change the result, and a mapped dictionary takes no new names.
+    void updatePrice(const StringRef& asset, const int32_t day, const float price) {
+      assert(series_index == SERIES_INDEX_SEGMENT_TREE);
+      uint32_t id;
+      if (asset_ids.find(asset, id)) {
+        static_cast<SeriesSegmentTree&>(*price_index).set(id, day, price);
+      }
+    }
+
+    void updateVolume(const StringRef& asset, const int32_t day, const float volume) {
+      assert(series_index == SERIES_INDEX_SEGMENT_TREE);
+      uint32_t id;
+      if (asset_ids.find(asset, id)) {
+        static_cast<SeriesSegmentTree&>(*volume_index).set(id, day, volume);
+      }
+    }
+
+    // Applies the rows of the price-over-time and volume-over-time sections
+    // of a CSV buffer as live updates, in order, so the last row of a day
+    // wins. Other sections are skipped. Returns the number of rows applied.
+    uint64_t applyUpdates(const char* buf, const size_t len) {
+      CsvLines lines;
+      tokenize_csv(buf, len, lines);
+      uint64_t applied = 0;
+      int table_flag = -1;
+      vector<int> columns;
+      size_t num_cols = 0;
+      for (size_t i = 0; i < lines.size(); i++) {
+        CsvLine l = lines.at(i);
+        if (l.at(0) == "<TABLE>") {
+          assert(i + 2 < lines.size());
+          TableSchema schema = TableSchema::fromHeader(l, lines.at(i + 1), lines.at(i + 2));
+          table_flag = schema.name == "price-over-time" ? PRICE_OVER_TIME :
+            schema.name == "volume-over-time" ? VOLUME_OVER_TIME : -1;
+          columns = queryColumnPositions(schema);
+          if (columns.empty()) {
+            table_flag = -1;
+          }
+          num_cols = schema.numColumns();
+          i += 2;
+          continue;
+        }
+        if (table_flag == -1) {
           continue;
-        } 
-        search = name_to_date_volume.find(name);
-        if (search != name_to_date_volume.end()) {
-          auto& date_to_volume = search->second;
-          valid_flag = true;
-          for (auto ite2 = date_to_volume.lower_bound(13); ite2 != date_to_volume.end() && ite2->first <= 268; ++ite2) {
-            if (ite2->second < 10.0) {
-              valid_flag = false;
-              break;
+        }
+        assert(l.size() == num_cols);
+        int32_t day = parse_int(l.at(columns[0]));
+        float value = parse_float(l.at(columns[2]));
+        if (table_flag == PRICE_OVER_TIME) {
+          updatePrice(l.at(columns[1]), day, value);
+        } else {
+          updateVolume(l.at(columns[1]), day, value);
+        }
+        applied++;
+      }
+      return applied;
+    }
+
+    // Prints how the prices and volumes of an asset are distributed on the
+    // days exe() looks at, 13 to 268, from the wavelet matrices alone, and
+    // how many trades it had on them. Needs series_index == SERIES_INDEX_WAVELET.
+    void printAssetReport(const StringRef& asset, std::ostream& out) const {
+      assert(series_index == SERIES_INDEX_WAVELET);
+      uint32_t id;
+      if (!asset_ids.find(asset, id)) {
+        out << "Asset " << asset << " is in no table" << endl;
+        return;
+      }
+      const SeriesWaveletIndex& price_wavelet = static_cast<const SeriesWaveletIndex&>(*price_index);
+      const SeriesWaveletIndex& volume_wavelet = static_cast<const SeriesWaveletIndex&>(*volume_index);
+      out << "Asset " << asset << " on days 13 to 268:" << endl;
+      out << "  prices: ";
+      printDistribution(price_wavelet, id, out);
+      out << ", " << price_wavelet.countAbove(id, 13, 268, 299.0) << " above 299" << endl;
+      out << "  volumes: ";
+      printDistribution(volume_wavelet, id, out);
+      out << ", " << volume_wavelet.countBelow(id, 13, 268, 10.0) << " below 10" << endl;
+      out << "  trades: " << trade_counts.count(id, 13, 268) << " of " << trade_counts.total(id) << endl;
+    }
+
+    virtual std::unique_ptr<Table> exe() {
+      // STUDENTS: FILL IN THIS FUNCTION
+
+      // Only the stock and bond partitions are visited
+      auto valid_stock_cnt = 0, valid_bond_cnt = 0;
+      uint32_t class_id;
+      if (class_ids.find(StringRef("stock", 5), class_id)) {
+        valid_stock_cnt = validTradeCount(class_to_ids[class_id]);
+      }
+      if (class_ids.find(StringRef("bond", 4), class_id)) {
+        valid_bond_cnt = validTradeCount(class_to_ids[class_id]);
+      }
+      return resultTable(valid_stock_cnt, valid_bond_cnt);
+    }
+
+    // The query of exe(), answered from the rows kept with retain_tables
+    // instead of the dictionaries, series and indexes that the load built.
+    // The columns are found by name through a RecordLayout of each table
+    // and read as typed arrays. Assets are interned into a dictionary of
+    // their own, and their rows staged into series of their own.
+    std::unique_ptr<Table> exeOverTables() const {
+      assert(retain_tables);
+      Arena arena;
+      StringDictionary names(arena);
+      vector<StringRef> asset_class;
+      vector<bool> tradable;
+      vector<int> trades;
+      SeriesCsr prices, volumes;
+      for (auto& table : tables) {
+        RecordLayout layout(table);
+        if (table.name == "tradable") {
+          auto asset = table.stringColumn(layout.slot("asset-name", FIELD_TYPE_STRING));
+          auto cls = table.stringColumn(layout.slot("asset-class", FIELD_TYPE_STRING));
+          for (size_t r = 0; r < table.numRows(); r++) {
+            uint32_t id = names.intern(asset[r]);
+            if (id >= tradable.size()) {
+              tradable.resize(id + 1, false);
+              asset_class.resize(id + 1);
+            }
+            if (!tradable[id]) {
+              tradable[id] = true;
+              asset_class[id] = cls[r];
+            }
+          }
+        } else if (table.name == "price-over-time" || table.name == "volume-over-time") {
+          bool is_price = table.name == "price-over-time";
+          auto& series = is_price ? prices : volumes;
+          const int32_t* day = table.intColumn(layout.slot("day", FIELD_TYPE_INT)).data();
+          auto asset = table.stringColumn(layout.slot("asset-name", FIELD_TYPE_STRING));
+          const float* val = table.floatColumn(layout.slot(is_price ? "price" : "volume", FIELD_TYPE_FLOAT)).data();
+          for (size_t r = 0; r < table.numRows(); r++) {
+            series.stage(names.intern(asset[r]), day[r], val[r]);
+          }
+        } else if (table.name == "trades") {
+          auto asset = table.stringColumn(layout.slot("asset-name", FIELD_TYPE_STRING));
+          for (size_t r = 0; r < table.numRows(); r++) {
+            uint32_t id = names.intern(asset[r]);
+            if (id >= trades.size()) {
+              trades.resize(id + 1, 0);
             }
+            trades[id]++;
           }
         }
-        if (valid_flag == true) {
-          if (ite->second == "stock") valid_stock_cnt += trades_ite->second.size();
-          else valid_bond_cnt += trades_ite->second.size();
-        } 
       }
+      tradable.resize(names.size(), false);
+      asset_class.resize(names.size());
+      trades.resize(names.size(), 0);
+      prices.build(names.size());
+      volumes.build(names.size());
+
+      auto valid_stock_cnt = 0, valid_bond_cnt = 0;
+      for (uint32_t id = 0; id < names.size(); id++) {
+        if (trades[id] == 0 || !tradable[id] || (asset_class[id] != "stock" && asset_class[id] != "bond")) {
+          continue;
+        }
+        auto valid_flag = false;
+        if (!prices.empty(id)) {
+          valid_flag = !anyOnQueryDays(prices, id, [](const float price) { return price > 299.0; });
+        }
+        if (!valid_flag && !volumes.empty(id)) {
+          valid_flag = !anyOnQueryDays(volumes, id, [](const float volume) { return volume < 10.0; });
+        }
+        if (valid_flag) {
+          (asset_class[id] == "stock" ? valid_stock_cnt : valid_bond_cnt) += trades[id];
+        }
+      }
+      return resultTable(valid_stock_cnt, valid_bond_cnt);
+    }
 
+  private:
+
+    static unique_ptr<Table> resultTable(const int valid_stock_cnt, const int valid_bond_cnt) {
       auto ret_table = new DenseTable(string("asset-class_counts"), {string("asset-class"), 
                             string("count")}, {FIELD_TYPE_STRING, FIELD_TYPE_INT});
-      vector<unique_ptr<Field> > record;
       if (valid_bond_cnt != 0) {
-        record.push_back(unique_ptr<Field>(new StringField("bond")));
-        record.push_back(unique_ptr<Field>(new IntField(valid_bond_cnt)));
-        ret_table->addRecord(record);
-        record.clear();
+        ret_table->addRow({Value::ofString(StringRef("bond", 4)), Value::ofInt(valid_bond_cnt)});
       }
       if (valid_stock_cnt != 0) {
-        record.push_back(unique_ptr<Field>(new StringField("stock")));
-        record.push_back(unique_ptr<Field>(new IntField(valid_stock_cnt)));
-        ret_table->addRecord(record);
+        ret_table->addRow({Value::ofString(StringRef("stock", 5)), Value::ofInt(valid_stock_cnt)});
       }
       return unique_ptr<Table>(ret_table);
     }
+
+    static void printDistribution(const SeriesWaveletIndex& wavelet, const uint32_t id, std::ostream& out) {
+      uint64_t n = wavelet.count(id, 13, 268);
+      out << n << " values";
+      if (n > 0) {
+        out << ", min " << wavelet.kth(id, 13, 268, 0) << ", median " << wavelet.kth(id, 13, 268, n / 2)
+          << ", max " << wavelet.kth(id, 13, 268, n - 1);
+      }
+    }
+
+    // Whether pred holds on any of days 13 to 268 of a series
+    template <typename Pred>
+    static bool anyOnQueryDays(const SeriesCsr& series, const uint32_t id, Pred pred) {
+      const float* values = series.values().data;
+      for (uint64_t i = series.lowerBound(id, 13), end = series.upperBound(id, 268); i < end; i++) {
+        if (pred(values[i])) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    uint32_t internAsset(const StringRef& name) {
+      uint32_t id = asset_ids.intern(name);
+      if (id == id_to_class.size()) {
+        id_to_class.push_back(SNAPSHOT_NO_CLASS);
+      }
+      return id;
+    }
+
+    // The first row of an asset in the tradable table wins
+    void addTradable(const uint32_t id, const StringRef& asset_class) {
+      if (id_to_class[id] == SNAPSHOT_NO_CLASS) {
+        uint32_t class_id = class_ids.intern(asset_class);
+        if (class_id == class_to_ids.size()) {
+          class_to_ids.push_back(vector<uint32_t>());
+        }
+        id_to_class[id] = class_id;
+        class_to_ids[class_id].push_back(id);
+        tradable_ids.push_back(id);
+      }
+    }
+
+    // Sums the trades of the assets whose prices never go above 299 or,
+    // failing that, whose volumes never go below 10 on days 13 to 268
+    int validTradeCount(const vector<uint32_t>& ids) const {
+      int valid_cnt = 0;
+      for (auto id : ids) {
+        auto trade_cnt = (int) trade_counts.total(id);
+        if (trade_cnt == 0)
+          continue;
+
+        auto valid_flag = false;
+        if (price_index->hasAny(id)) {
+          valid_flag = !price_index->anyAbove(id, 13, 268, 299.0);
+        }
+        if (valid_flag == true) {
+          valid_cnt += trade_cnt;
+          continue;
+        }
+        if (volume_index->hasAny(id)) {
+          valid_flag = !volume_index->anyBelow(id, 13, 268, 10.0);
+        }
+        if (valid_flag == true) {
+          valid_cnt += trade_cnt;
+        }
+      }
+      return valid_cnt;
+    }
+
+    void buildIndexes() {
+      price_index.reset(new_series_index(series_index, RANGE_MAX));
+      volume_index.reset(new_series_index(series_index, RANGE_MIN));
+      price_index->build(price_series);
+      volume_index->build(volume_series);
+    }
 };
 
 // -------------------------------------------------
 // The driver function 
 // -------------------------------------------------
 int main(const int argc, const char** argv) {
-  if (argc != 2) {
-    cout << "Error: Usage: ./fakedb <input_tables_file>" << endl;
-    return -1;
-  }
+  ReferenceQueryEngine engine;
 
-  string tableFile = argv[1];
+  int numThreads = std::thread::hardware_concurrency();
+  CsvScanner scanner = SCANNER_MEMCHR;
+  bool stream = false;
+  bool fromTables = false;
+  string snapshotIn, snapshotOut, updatesFile, reportAsset;
+  string tableFile;
+  bool badArgs = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.compare(0, 10, "--threads=") == 0) {
+      numThreads = stoi(arg.substr(10));
+    } else if (arg == "--scanner=simd") {
+      scanner = SCANNER_SIMD;
+    } else if (arg == "--scanner=memchr") {
+      scanner = SCANNER_MEMCHR;
+    } else if (arg == "--stream") {
+      stream = true;
+    } else if (arg == "--retain-tables") {
+      engine.retain_tables = true;
+    } else if (arg == "--from-tables") {
+      // Runs the query over the retained rows
+      engine.retain_tables = true;
+      fromTables = true;
+    } else if (arg == "--series-index=hybrid") {
+      engine.series_index = SERIES_INDEX_HYBRID;
+    } else if (arg == "--series-index=rmq") {
+      engine.series_index = SERIES_INDEX_RMQ;
+    } else if (arg == "--series-index=segtree") {
+      engine.series_index = SERIES_INDEX_SEGMENT_TREE;
+    } else if (arg == "--series-index=zonemap") {
+      engine.series_index = SERIES_INDEX_ZONE_MAP;
+    } else if (arg == "--series-index=wavelet") {
+      engine.series_index = SERIES_INDEX_WAVELET;
+    } else if (arg == "--series-index=gorilla") {
+      engine.series_index = SERIES_INDEX_GORILLA;
+    } else if (arg == "--series-index=packed") {
+      engine.series_index = SERIES_INDEX_PACKED_DAYS;
+    } else if (arg.compare(0, 16, "--save-snapshot=") == 0) {
+      snapshotOut = arg.substr(16);
+    } else if (arg.compare(0, 16, "--load-snapshot=") == 0) {
+      snapshotIn = arg.substr(16);
+    } else if (arg.compare(0, 10, "--updates=") == 0) {
+      updatesFile = arg.substr(10);
+    } else if (arg.compare(0, 15, "--asset-report=") == 0) {
+      reportAsset = arg.substr(15);
+    } else if (tableFile.empty() && arg.compare(0, 2, "--") != 0) {
+      tableFile = arg;
+    } else {
+      badArgs = true;
+    }
+  }
 
-  std::ifstream t(tableFile);
-  std::string str((std::istreambuf_iterator<char>(t)),
-      std::istreambuf_iterator<char>());
+  // The tables come from either a CSV file or a snapshot
+  // Only the segment trees take updates, and only the wavelet matrices report
+  if (badArgs || tableFile.empty() == snapshotIn.empty() || (fromTables && !snapshotIn.empty()) ||
+      (!updatesFile.empty() && engine.series_index != SERIES_INDEX_SEGMENT_TREE) ||
+      (!reportAsset.empty() && engine.series_index != SERIES_INDEX_WAVELET)) {
+    cout << "Error: Usage: ./fakedb [--threads=N] [--scanner=memchr|simd] [--stream] [--retain-tables] [--from-tables] "
+      << "[--series-index=hybrid|rmq|segtree|zonemap|wavelet|gorilla|packed] [--save-snapshot=<snapshot_file>] <input_tables_file>" << endl;
+    cout << "       ./fakedb [--series-index=hybrid|rmq|segtree|zonemap|wavelet|gorilla|packed] --load-snapshot=<snapshot_file>" << endl;
+    cout << "       Either form also takes --series-index=segtree --updates=<input_tables_file>" << endl;
+    cout << "       or --series-index=wavelet --asset-report=<asset_name>" << endl;
+    return -1;
+  }
 
-  ReferenceQueryEngine engine;
+  // Load the tables for the query, either streamed through a
+  // fixed size buffer or in parallel from a memory mapping
+  auto load_start = std::chrono::system_clock::now();
+  uint64_t numLines;
+  if (!snapshotIn.empty()) {
+    if (!engine.loadSnapshot(snapshotIn, numLines)) {
+      cout << "Error: " << snapshotIn << " is not a valid snapshot" << endl;
+      return -1;
+    }
+  } else if (stream) {
+    std::ifstream in(tableFile, std::ios::binary);
+    StreamingCsvLoader loader(1 << 22, scanner);
+    numLines = loader.load(in, engine);
+  } else {
+    MappedFile file(tableFile);
+    ParallelCsvLoader loader(numThreads, scanner);
+    numLines = loader.load(file.data(), file.size(), engine);
+  }
+  std::chrono::duration<double> load_time = std::chrono::system_clock::now() - load_start;
 
-  vector<string> lines = split_at(str, "\n");
-  lines.pop_back();
-  vector<vector<string> > csvLines;
-  for (auto l : lines) {
-    csvLines.push_back(split_at(l, ","));
+  if (!snapshotOut.empty() && !engine.saveSnapshot(snapshotOut, numLines)) {
+    cout << "Error: Could not write snapshot " << snapshotOut << endl;
+    return -1;
   }
 
-  cout << "Input table file " << tableFile << " has " << lines.size() << " lines" << endl;
+  if (!snapshotIn.empty()) {
+    cout << "Snapshot file " << snapshotIn << " holds a table file of " << numLines << " lines" << endl;
+  } else {
+    cout << "Input table file " << tableFile << " has " << numLines << " lines" << endl;
+  }
 
-  // Load the tables for the query
-  engine.loadTablesFromCSV(csvLines);
+  // Applied after the snapshot is written, which only holds the loaded tables
+  if (!updatesFile.empty()) {
+    MappedFile updates(updatesFile);
+    cout << "Applied " << engine.applyUpdates(updates.data(), updates.size())
+      << " updates from " << updatesFile << endl;
+  }
 
   // Run and time the query using several runs to remove
   // cold-start overhead and noise
@@ -577,7 +4564,7 @@ int main(const int argc, const char** argv) {
     double total_elapsed = 0.;
 
     auto start = std::chrono::system_clock::now();
-    table = engine.exe();
+    table = fromTables ? engine.exeOverTables() : engine.exe();
     auto end = std::chrono::system_clock::now();
     std::chrono::duration<double> elapsed = end - start;
 
@@ -591,7 +4578,12 @@ int main(const int argc, const char** argv) {
   std::cout << "Result:" << endl;
   cout << *table << endl;
 
+  if (!reportAsset.empty()) {
+    engine.printAssetReport(StringRef(reportAsset.data(), reportAsset.size()), cout);
+  }
+
   // Uncomment this line to see the timing information for your code
+  // std::cout << "Load Runtime: " << load_time.count() << " seconds" << std::endl;
   // std::cout << "Query Runtime: " << min_time << " seconds" << std::endl;
   return 0;
 }